@@ -7,9 +7,75 @@
  *
  *  - A custom IOCTL interface for device‑specific commands.
  *      - XSERVE_FP_IOCTL_GET_STATUS: Retrieve device status.
+ *      - XSERVE_FP_IOCTL_GET_STATUS_EX: Same, with cache age and a force-refresh flag.
  *      - XSERVE_FP_IOCTL_SET_LED: Set LED brightness (or similar JUST FOR EXAMPLE, ok?).
+ *      - XSERVE_FP_IOCTL_SET_LED_EX: Set any panel LED, optionally write-through.
+ *      - XSERVE_FP_IOCTL_READ_EVENTS: Dequeue timestamped interrupt events.
+ *      - XSERVE_FP_IOCTL_BATCH: Pipeline an array of vendor control requests.
+ *      - XSERVE_FP_IOCTL_ANIMATE: Upload a keyframe animation the driver plays.
  *
  *  - Handling an interrupt endpoint to asynchronously receive events from the device.
+ *    Two URBs with separate buffers stay queued, so the endpoint is still polled
+ *    while a completion is processed. Each report is decoded once into a typed
+ *    event (button, status, error) through a per-device protocol table selected
+ *    by the USB id. It is numbered and copied into a lockless single-producer
+ *    event queue and into the per-open event rings that userspace has mapped
+ *    with mmap(). Errors do not stop the stream: a stalled endpoint is cleared
+ *    and the URBs are resubmitted with exponential backoff from a work item.
+ *
+ *  - An input device: panel buttons are reported as key events through evdev,
+ *    with a keymap that userspace can change with EVIOCSKEYCODE.
+ *
+ *  - A streaming bulk-IN engine: a pool of anchored URBs is kept in flight while the
+ *    device is open and read() is served from a per-device ring buffer.
+ *
+ *  - An asynchronous bulk-OUT path: write() copies its data in chunks into a fixed
+ *    pool of preallocated URBs and returns once they are queued. Errors are reported on the
+ *    next write() or flush/fsync of the file that queued them. Large blocking writes skip the copy: the
+ *    user pages are pinned and sent as one scatter-gather transfer.
+ *
+ *  - Per-CPU transfer statistics in debugfs (xserve_fp/<interface>/stats): counts,
+ *    bytes, errors by errno and log2 latency histograms per endpoint, plus
+ *    in_mutex/out_mutex wait histograms. Writing to reset clears them.
+ *
+ *  - Tracepoints (events/xserve_fp/) for read, write and ioctl entry and exit,
+ *    the copy-out of read data, and every URB submission and completion.
+ *
+ *  - poll()/epoll support and O_NONBLOCK semantics for read and write.
+ *
+ *  - Per-open file contexts: every open file has its own cursors into the
+ *    bulk-IN ring and the event queue, an event type mask, a nonblocking flag
+ *    and statistics (GET_CLIENT/SET_CLIENT). Readers do not take data from
+ *    each other, and the rings are not copied per reader: a reader that
+ *    falls a whole ring behind skips ahead and the loss is counted.
+ *
+ *  - Reference-counted device lifetime: open() looks the device up by minor in
+ *    an xarray and takes a kref, so a panel unplugged while open is freed by
+ *    the last release(). Disconnect is fenced with SRCU instead of a lock.
+ *
+ *  - LED shadow state: SET_LED only updates the shadow and a delayed worker
+ *    sends the changed values, at most once per led_flush_ms.
+ *
+ *  - LED class devices (xserve_fpN::indicator, xserve_fpN::cpuB-S) for every
+ *    panel LED, so kernel triggers can drive the panel. Blinking and the
+ *    pattern trigger's hardware patterns run in the driver, without a
+ *    userspace loop, on the same keyframe players as ANIMATE: one hrtimer
+ *    per LED with gamma and easing lookup tables.
+ *
+ *  - An optional CPU activity meter that samples the CPU load every
+ *    cpu_meter_ms and shows it on the two bars through the LED shadow.
+ *
+ *  - A pool of preallocated control URBs with DMA-safe setup packets and data
+ *    buffers. Vendor requests are queued on it and overlap with each other and
+ *    with bulk traffic; callers choose whether to wait for the result.
+ *
+ *  - A cached device status, refreshed by status interrupts or, for devices
+ *    that do not send them, by a background poller. GET_STATUS is served from
+ *    the cache while it is younger than status_max_age_ms.
+ *
+ *  - A read-only status page for mmap() with the status word, the LED shadow
+ *    and event counters, guarded by a sequence count so readers take
+ *    consistent snapshots with plain loads, as with the vDSO.
  *
  */
 
@@ -21,41 +87,519 @@
  #include <linux/fs.h>
  #include <linux/uaccess.h>
  #include <linux/errno.h>
+ #include <linux/spinlock.h>
+ #include <linux/wait.h>
+ #include <linux/vmalloc.h>
+ #include <linux/semaphore.h>
+ #include <linux/srcu.h>
+ #include <linux/kref.h>
+ #include <linux/xarray.h>
+ #include <linux/poll.h>
+ #include <linux/ktime.h>
+ #include <linux/mm.h>
+ #include <linux/list.h>
+ #include <linux/log2.h>
+ #include <linux/scatterlist.h>
+ #include <linux/workqueue.h>
+ #include <linux/bitmap.h>
+ #include <linux/sched/signal.h>
+ #include <linux/completion.h>
+ #include <linux/debugfs.h>
+ #include <linux/percpu.h>
+ #include <linux/seq_file.h>
+ #include <linux/input.h>
+ #include <linux/usb/input.h>
+ #include <linux/leds.h>
+ #include <linux/hrtimer.h>
+ #include <linux/version.h>
+ #include <linux/kernel_stat.h>
+ #include <linux/tick.h>
+ 
+ #include "driver_ioctl.h"
+ 
+ #define CREATE_TRACE_POINTS
+ #include "xserve_fp_trace.h"
  
  #define VENDOR_ID         0x05AC   /* Apple Vendor ID */
  #define PRODUCT_ID        0x821B   /* Sample Product ID for Xserve Front Panel */
  #define XSERVE_FP_BUFSIZE 512
  #define XSERVE_FP_MINOR_BASE 192
  
- /* Device-specific IOCTL commands */
- #define XSERVE_FP_IOCTL_GET_STATUS _IOR('x', 1, int)
- #define XSERVE_FP_IOCTL_SET_LED    _IOW('x', 2, int)
+ /* Streaming bulk-IN engine */
+ #define XSERVE_FP_IN_URBS      4            /* bulk-IN URBs kept in flight */
+ #define XSERVE_FP_IN_RING_MIN  (64 * 1024)  /* ring holds at least 4 rounds of URBs */
+ #define XSERVE_FP_IN_XFER_MAX  (256 * 1024) /* cap for bulk_in_xfer_size */
+ #define XSERVE_FP_IN_SYNC_MAX  (16 * 1024)  /* cap without streaming, a kmalloc() buffer */
+ #define XSERVE_FP_IN_TIMEOUT   5000         /* ms per synchronous bulk-IN transfer */
+ #define XSERVE_FP_IN_BACKOFF_MIN 10         /* ms before the first recovery attempt */
+ #define XSERVE_FP_IN_BACKOFF_MAX 2000U      /* ms cap of the doubling retry delay */
+ 
+ /* Asynchronous bulk-OUT path */
+ #define XSERVE_FP_OUT_URBS     8            /* chunks in flight at once */
+ #define XSERVE_FP_OUT_BUFSIZE  4096         /* bytes per chunk */
+ #define XSERVE_FP_OUT_TIMEOUT  5000         /* ms flush waits for queued writes */
+ #define XSERVE_FP_SG_MAX       (4 << 20)    /* largest zero-copy write per call */
+ #define XSERVE_FP_SG_TIMEOUT   5000         /* ms a zero-copy write may take */
+ 
+ /* Vendor requests. The bRequest values are arbitrary and should match your hardware. */
+ #define XSERVE_FP_REQ_GET_STATUS 0x01
+ #define XSERVE_FP_REQ_SET_LED    0x02       /* wValue = brightness, wIndex = LED */
+ #define XSERVE_FP_CTRL_TIMEOUT   1000       /* ms per control request */
+ 
+ /* Interrupt reports: byte 0 is the report type */
+ #define XSERVE_FP_REPORT_BUTTON  0x01       /* byte 1: button, byte 2: nonzero while pressed */
+ #define XSERVE_FP_REPORT_STATUS  0x02       /* bytes 1-4: status word, little endian */
+ #define XSERVE_FP_REPORT_ERROR   0x03       /* byte 1: error code, bytes 2-3: detail */
+ 
+ /* Control URB pool shared by ioctls, the LED flush worker and the status cache */
+ #define XSERVE_FP_CTRL_URBS      8          /* control requests in flight at once */
+ #define XSERVE_FP_CTRL_BUFSIZE   XSERVE_FP_CTRL_DATA_MAX  /* data stage per slot */
+ #define XSERVE_FP_CTRL_DETACHED  4          /* slots detached requests may hold at once */
+ 
+ /* Interrupt event queue */
+ #define XSERVE_FP_EVENT_QUEUE  256          /* records, must be a power of two */
+ #define XSERVE_FP_IRQ_URBS     2            /* interrupt URBs kept queued */
+ #define XSERVE_FP_IRQ_BACKOFF_MIN 10        /* ms before the first recovery attempt */
+ #define XSERVE_FP_IRQ_BACKOFF_MAX 2000      /* ms cap of the doubling retry delay */
+ 
+ /* debugfs statistics */
+ #define XSERVE_FP_HIST_BUCKETS 24           /* log2 microsecond buckets, up to ~8 s */
+ #define XSERVE_FP_STAT_ERRNOS  128          /* errnos counted one by one; slot 0 is "other" */
+ 
+ enum {
+     XSERVE_FP_EP_BULK_IN,
+     XSERVE_FP_EP_BULK_OUT,
+     XSERVE_FP_EP_INT,
+     XSERVE_FP_EP_CTRL,
+     XSERVE_FP_NR_EPS,
+ };
+ 
+ enum {
+     XSERVE_FP_LOCK_IN,                  /* in_mutex, or a file's read_mutex when streaming */
+     XSERVE_FP_LOCK_OUT,                 /* out_mutex */
+     XSERVE_FP_NR_LOCKS,
+ };
+ 
+ /* How one interrupt report type decodes into a struct xserve_fp_report */
+ struct xserve_fp_report_desc {
+     u8 id;                          /* byte 0 of the report */
+     u8 min_len;                     /* shorter reports are passed on undecoded */
+     u16 type;                       /* XSERVE_FP_EV_* */
+     u8 code_off;                    /* byte holding the code, 0 if none */
+     u8 value_off;                   /* first byte of the value */
+     u8 value_len;                   /* value bytes, little endian, 0 to 4 */
+ };
+ 
+ /* Buttons the input device can report */
+ #define XSERVE_FP_MAX_KEYS       8
+ 
+ /* A device's interrupt report protocol, selected through usb_device_id.driver_info */
+ struct xserve_fp_protocol {
+     const struct xserve_fp_report_desc *reports;
+     unsigned int nr_reports;
+     const unsigned short *keymap;   /* button code to key code, remappable via evdev */
+     unsigned int nr_keys;           /* at most XSERVE_FP_MAX_KEYS */
+ };
+ 
+ static const struct xserve_fp_report_desc xserve_fp_reports[] = {
+     { .id = XSERVE_FP_REPORT_BUTTON, .min_len = 3, .type = XSERVE_FP_EV_BUTTON,
+       .code_off = 1, .value_off = 2, .value_len = 1 },
+     { .id = XSERVE_FP_REPORT_STATUS, .min_len = 5, .type = XSERVE_FP_EV_STATUS,
+       .value_off = 1, .value_len = 4 },
+     { .id = XSERVE_FP_REPORT_ERROR,  .min_len = 4, .type = XSERVE_FP_EV_ERROR,
+       .code_off = 1, .value_off = 2, .value_len = 2 },
+ };
+ 
+ static const unsigned short xserve_fp_keymap[] = {
+     KEY_PROG1,                      /* 0: system identifier button */
+     KEY_PROG2,
+     KEY_PROG3,
+     KEY_PROG4,
+ };
+ 
+ static const struct xserve_fp_protocol xserve_fp_protocol = {
+     .reports    = xserve_fp_reports,
+     .nr_reports = ARRAY_SIZE(xserve_fp_reports),
+     .keymap     = xserve_fp_keymap,
+     .nr_keys    = ARRAY_SIZE(xserve_fp_keymap),
+ };
  
  /* Table of devices that work with this driver */
  static const struct usb_device_id xserve_fp_table[] = {
-     { USB_DEVICE(VENDOR_ID, PRODUCT_ID) },
+     { USB_DEVICE(VENDOR_ID, PRODUCT_ID),
+       .driver_info = (kernel_ulong_t)&xserve_fp_protocol },
      {} /* Terminating entry */
  };
  MODULE_DEVICE_TABLE(usb, xserve_fp_table);
  
+ static bool stream_in = true;
+ module_param(stream_in, bool, 0444);
+ MODULE_PARM_DESC(stream_in, "Keep bulk-IN URBs in flight and serve read() from a ring buffer");
+ 
+ static unsigned int bulk_in_xfer_size = 16 * 1024;
+ module_param(bulk_in_xfer_size, uint, 0644);
+ MODULE_PARM_DESC(bulk_in_xfer_size,
+                  "Bytes per bulk-IN transfer, rounded to whole packets (applies to devices probed afterwards)");
+ 
+ static unsigned int sg_write_threshold = 64 * 1024;
+ module_param(sg_write_threshold, uint, 0644);
+ MODULE_PARM_DESC(sg_write_threshold,
+                  "Blocking writes of at least this many bytes pin user pages instead of copying (0 = never)");
+ 
+ static unsigned int led_flush_ms = 20;
+ module_param(led_flush_ms, uint, 0644);
+ MODULE_PARM_DESC(led_flush_ms, "Minimum interval between LED updates sent to the device");
+ 
+ static unsigned int status_max_age_ms = 100;
+ module_param(status_max_age_ms, uint, 0644);
+ MODULE_PARM_DESC(status_max_age_ms, "Serve GET_STATUS from the cache while younger than this (0 = never)");
+ 
+ /* Fastest sampling of the CPU activity meter */
+ #define XSERVE_FP_CPU_METER_MIN_MS 10
+ 
+ static unsigned int cpu_meter_ms;
+ module_param(cpu_meter_ms, uint, 0444);
+ MODULE_PARM_DESC(cpu_meter_ms,
+                  "Initial sampling interval of the CPU activity meter on the bars (0 = off, bars left to userspace)");
+ 
+ /* CPU time at the previous meter sample, in nanoseconds */
+ struct xserve_fp_cpu_sample {
+     u64 busy;
+     u64 total;
+ };
+ 
+ struct xserve_fp;
+ 
+ /* A decoded interrupt report, handed to every consumer */
+ struct xserve_fp_report {
+     u16 type;                       /* XSERVE_FP_EV_* */
+     u16 code;
+     u32 value;
+ };
+ 
+ /* Context of every URB the driver submits */
+ struct xserve_fp_urb {
+     struct xserve_fp *dev;
+     u64 submit_ns;                  /* ktime of the last submission */
+ };
+ 
+ /* Context of a bulk-OUT URB: the file whose write() queued it */
+ struct xserve_fp_out_urb {
+     struct xserve_fp_urb ctx;       /* for xserve_fp_submit_urb() */
+     struct xserve_fp_client *client;
+ };
+ 
+ /* Transfer statistics of one endpoint */
+ struct xserve_fp_ep_stats {
+     u64 xfers;                      /* completed transfers */
+     u64 bytes;
+     u64 errors[XSERVE_FP_STAT_ERRNOS];  /* by -status */
+     u64 latency[XSERVE_FP_HIST_BUCKETS];  /* submit to completion */
+ };
+ 
+ /* Per-CPU statistics shown in debugfs; updated with this_cpu ops only */
+ struct xserve_fp_stats {
+     struct xserve_fp_ep_stats ep[XSERVE_FP_NR_EPS];
+     u64 lock_wait[XSERVE_FP_NR_LOCKS][XSERVE_FP_HIST_BUCKETS];
+ };
+ 
+ /*
+  * One slot of the control URB pool. The setup packet and the data stage are
+  * allocated once in probe, so queueing a request never allocates.
+  */
+ struct xserve_fp_ctrl {
+     struct xserve_fp_urb ctx;       /* URB context, must stay first */
+     struct urb *urb;
+     struct usb_ctrlrequest *setup;  /* kmalloc()ed, DMA-safe */
+     unsigned char *buf;             /* coherent data stage, XSERVE_FP_CTRL_BUFSIZE */
+     struct completion done;
+     bool detached;                  /* recycled on completion, nobody waits */
+     int status;                     /* bytes transferred or negative errno */
+     unsigned int cookie;            /* owner's tag for the request */
+ };
+ 
+ static struct dentry *xserve_fp_debugfs_root;  /* debugfs/xserve_fp/ */
+ 
+ /* Bound devices by minor, so open() finds its device in constant time */
+ static DEFINE_XARRAY(xserve_fp_devs);
+ 
+ /* One panel LED as a LED class device; blinking and patterns run on its player */
+ struct xserve_fp_led_cdev {
+     struct led_classdev cdev;
+     struct xserve_fp *dev;
+     unsigned int index;             /* XSERVE_FP_LED_ID or XSERVE_FP_LED_BAR() */
+     bool registered;
+     char name[32];
+ };
+ 
+ #define XSERVE_FP_EASE_COUNT     (XSERVE_FP_EASE_IN_OUT + 1)
+ 
+ /*
+  * Keyframe player of one LED. An hrtimer walks the keyframes and writes the
+  * output to the LED shadow: once per led_flush_ms while fading, once per
+  * keyframe while holding, and never when the output would not change.
+  */
+ struct xserve_fp_player {
+     struct hrtimer timer;
+     struct xserve_fp *dev;
+     unsigned int led;
+     struct xserve_fp_keyframe keys[XSERVE_FP_ANIM_MAX_KEYS];
+     unsigned int count;             /* keyframes, 0 when idle */
+     unsigned int key;               /* keyframe playing */
+     unsigned int repeat;            /* passes left, 0 forever */
+     bool gamma;
+     u8 from;                        /* level the keyframe fades from */
+     ktime_t key_start;
+     spinlock_t lock;                /* protects the fields above */
+     int out;                        /* last output, -1 if none; timer only */
+ };
+ 
+ /* Gamma 2.2: perceived level to LED brightness */
+ static const u8 xserve_fp_gamma[256] = {
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+     1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+     3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6,
+     6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10, 11, 11, 11, 12,
+     12, 13, 13, 13, 14, 14, 15, 15, 16, 16, 17, 17, 18, 18, 19, 19,
+     20, 20, 21, 22, 22, 23, 23, 24, 25, 25, 26, 26, 27, 28, 28, 29,
+     30, 30, 31, 32, 33, 33, 34, 35, 35, 36, 37, 38, 39, 39, 40, 41,
+     42, 43, 43, 44, 45, 46, 47, 48, 49, 49, 50, 51, 52, 53, 54, 55,
+     56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71,
+     73, 74, 75, 76, 77, 78, 79, 81, 82, 83, 84, 85, 87, 88, 89, 90,
+     91, 93, 94, 95, 97, 98, 99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+     113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+     137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+     163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+     192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+     223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+ };
+ 
+ /* Easing curves by progress 0 to 255, filled at module init */
+ static u8 xserve_fp_ease[XSERVE_FP_EASE_COUNT][256] __ro_after_init;
+ 
  /* Device-specific structure */
  struct xserve_fp {
      struct usb_device *udev;
      struct usb_interface *interface;
+     int minor;                      /* of the /dev node, kept for tracing */
  
      /* Bulk endpoints */
      unsigned char *bulk_in_buffer;
-     size_t bulk_in_size;
+     size_t bulk_in_size;            /* bytes per transfer, a multiple of bulk_in_maxp */
+     size_t bulk_in_maxp;
      __u8 bulk_in_endpointAddr;
      __u8 bulk_out_endpointAddr;
  
-     /* Interrupt endpoint for asynchronous events */
-     unsigned char *irq_buffer;
+     /*
+      * Interrupt endpoint for asynchronous events. Several URBs, each with its
+      * own buffer, stay queued so the host keeps polling while a completion
+      * is processed.
+      */
      size_t irq_buffer_size;
      __u8 irq_endpointAddr;
-     struct urb *irq_urb;
+     __u8 irq_interval;
+     struct urb *irq_urbs[XSERVE_FP_IRQ_URBS];
+     struct xserve_fp_urb irq_ctx[XSERVE_FP_IRQ_URBS];
+     struct usb_anchor irq_anchor;
+     spinlock_t irq_lock;            /* serializes completions as event producers */
+ 
+     /* Decoder of this device's protocol: report id to descriptor, O(1) per report */
+     const struct xserve_fp_report_desc *report_map[256];
+ 
+     /* Panel buttons as an evdev input device, fed by the decoded reports */
+     struct input_dev *input;
+     char input_phys[64];
+     unsigned short keymap[XSERVE_FP_MAX_KEYS];
+ 
+     /*
+      * Interrupt endpoint recovery. A failed URB is parked and irq_work
+      * restarts the endpoint, clearing a halt first, with a delay that doubles
+      * per attempt until a report arrives again. Protected by irq_lock.
+      */
+     struct delayed_work irq_work;
+     bool irq_recovering;
+     bool irq_restarted;             /* irq_work resubmitted since the last error */
+     bool irq_stalled;               /* clear the halt before resubmitting */
+     unsigned int irq_backoff_ms;    /* delay of the next attempt */
+     u64 irq_fault_ns;               /* ktime of the first error of this episode */
+     unsigned long irq_errors;       /* failed completions */
+     unsigned long irq_stalls;       /* of which -EPIPE */
+     unsigned long irq_recoveries;
+     u64 irq_recover_last_ns;        /* first error to first good report after the restart */
+     u64 irq_recover_max_ns;
+ 
+     /*
+      * Interrupt event queue. The interrupt URB callbacks are the only producer
+      * and advance ev_head under irq_lock, overwriting the oldest record. Each
+      * open file reads it through its own cursor, see struct xserve_fp_client.
+      */
+     struct xserve_fp_event ev_queue[XSERVE_FP_EVENT_QUEUE];
+     unsigned int ev_head;
+     unsigned long ev_lost;          /* records overwritten before a reader got them */
+     u32 ev_seq;                     /* sequence number of the next report */
+     wait_queue_head_t ev_wait;
+ 
+     /* Event rings mapped by userspace, fed alongside ev_queue */
+     struct list_head ev_rings;
+     spinlock_t ev_rings_lock;
+ 
+     /*
+      * LED shadow state. led_shadow holds what callers asked for, led_hw what
+      * the device last acknowledged; led_dirty marks the LEDs the flush worker
+      * still has to send. led_mutex orders flushes and write-through updates.
+      */
+     u8 led_shadow[XSERVE_FP_NUM_LEDS];
+     u8 led_hw[XSERVE_FP_NUM_LEDS];
+     DECLARE_BITMAP(led_hw_valid, XSERVE_FP_NUM_LEDS);
+     DECLARE_BITMAP(led_dirty, XSERVE_FP_NUM_LEDS);
+     spinlock_t led_lock;            /* protects the four fields above */
+     struct mutex led_mutex;
+     struct delayed_work led_work;
+     unsigned long led_last_flush;   /* jiffies */
+     struct xserve_fp_led_cdev leds[XSERVE_FP_NUM_LEDS];
+     struct xserve_fp_player anim[XSERVE_FP_NUM_LEDS];
+ 
+     /*
+      * CPU activity meter: every cpu_meter_ms the bars are set from the CPU
+      * load through the LED shadow, so only changed segments are sent.
+      */
+     unsigned int cpu_meter_ms;      /* 0 when off */
+     struct xserve_fp_cpu_sample *cpu_meter_prev;  /* [nr_cpu_ids] */
+     struct delayed_work cpu_meter_work;
+ 
+     /*
+      * Cached device status. Status interrupts update it directly; once one
+      * has been seen (status_pushed) the background poller stops for good.
+      */
+     u32 status;
+     u64 status_stamp_ns;            /* ktime of the last update, 0 if none */
+     bool status_pushed;
+     unsigned long status_hits;
+     unsigned long status_misses;
+     spinlock_t status_lock;         /* protects the fields above */
+     struct mutex status_mutex;      /* serializes refreshes */
+     struct delayed_work status_work;
+ 
+     /* Streaming bulk-IN engine (stream_in=1) */
+     bool stream_in;
+     struct urb *in_urbs[XSERVE_FP_IN_URBS];
+     struct xserve_fp_urb in_ctx[XSERVE_FP_IN_URBS];
+     struct usb_anchor in_anchor;
+     unsigned char *in_ring;
+     size_t in_ring_size;            /* a power of two */
+     unsigned long in_head;          /* producer position, advanced by completions */
+     spinlock_t in_lock;             /* serializes ring producers, in_error and the counts */
+     wait_queue_head_t in_wait;
+     int in_error;                   /* URB error reported to the next reader */
+     unsigned long in_overflows;     /* reader overruns: a file fell a ring behind */
+     unsigned long in_dropped_bytes; /* bytes those readers skipped */
+ 
+     /*
+      * Bulk-IN recovery, as for the interrupt endpoint: a failed URB is parked
+      * and in_work restarts the stream, clearing a halt first, with a delay
+      * that doubles per attempt until data arrives again. Protected by
+      * in_lock; in_running is false while no file is open.
+      */
+     struct delayed_work in_work;
+     bool in_running;
+     bool in_recovering;
+     bool in_stalled;                /* clear the halt before resubmitting */
+     unsigned int in_backoff_ms;     /* delay of the next attempt */
+ 
+     /* Asynchronous bulk-OUT path */
+     struct urb *out_urbs[XSERVE_FP_OUT_URBS];
+     struct xserve_fp_out_urb out_ctx[XSERVE_FP_OUT_URBS];
+     struct urb *out_free[XSERVE_FP_OUT_URBS];  /* idle URBs, a stack */
+     int out_nfree;
+     struct semaphore limit_sem;     /* limits the number of chunks in flight */
+     struct mutex out_mutex;         /* keeps each write() contiguous on the wire */
+     spinlock_t out_lock;            /* protects out_free and the files' out_error */
+     wait_queue_head_t out_wait;     /* woken when a write URB is returned */
+     struct list_head sg_writes;     /* zero-copy writes in flight */
+     struct mutex sg_mutex;          /* protects sg_writes */
+ 
+     /* Endpoint 0: a pool of preallocated control URBs with DMA-safe buffers */
+     struct xserve_fp_ctrl ctrl[XSERVE_FP_CTRL_URBS];
+     struct xserve_fp_ctrl *ctrl_free[XSERVE_FP_CTRL_URBS];  /* idle slots, a stack */
+     int ctrl_nfree;
+     struct usb_anchor ctrl_anchor;  /* poisoned by disconnect */
+     struct semaphore ctrl_sem;      /* counts idle slots */
+     struct semaphore ctrl_detached_sem; /* keeps slots free if detached requests hang */
+     spinlock_t ctrl_lock;           /* protects ctrl_free and ctrl_errors */
+     unsigned long ctrl_errors;      /* failed requests nobody waited for */
+ 
+     /*
+      * Bulk-IN, bulk-OUT and endpoint 0 traffic do not share a lock: a reader
+      * blocked on the IN endpoint never stalls writers or ioctls. URB submission
+      * only enters a disconnect_srcu read section, which takes no lock, so the
+      * three paths run concurrently. Disconnect sets disconnected and waits for
+      * the sections in progress with synchronize_srcu().
+      */
+     struct mutex in_mutex;          /* serializes synchronous bulk-IN readers */
+     struct usb_anchor sync_anchor;  /* their URB, poisoned by disconnect */
+     struct mutex open_mutex;        /* protects open_count and stream start/stop */
+     struct srcu_struct disconnect_srcu;
+     int open_count;
+     bool disconnected;
+ 
+     /* One reference for the bound interface, one per open file */
+     struct kref kref;
  
-     struct mutex io_mutex;  /* synchronize I/O */
+     struct xserve_fp_stats __percpu *stats;
+     struct dentry *debugfs;         /* debugfs/xserve_fp/<interface>/ */
+ 
+     /* Read-only page mapped at XSERVE_FP_MMAP_STATUS, a copy of the state above */
+     struct xserve_fp_status_page *spage;  /* vmalloc_user(), one page */
+     spinlock_t spage_lock;          /* serializes writers; readers use spage->seq */
+ };
+ 
+ /* An mmap()ed event ring; see struct xserve_fp_ring_header */
+ struct xserve_fp_ring {
+     struct list_head node;          /* on dev->ev_rings */
+     struct xserve_fp_ring_header *hdr;  /* vmalloc_user() area, hdr at offset 0 */
+     struct xserve_fp_event *records;
+     size_t bytes;                   /* mapping length it was sized for */
+     unsigned int size;              /* records, a power of two */
+     unsigned int head;              /* driver's copy, userspace cannot corrupt it */
+     struct xserve_fp_client *client;    /* owner, for its event mask */
+ };
+ 
+ /*
+  * Per-open state, stored in file->private_data. The bulk-IN ring and the
+  * event queue are shared; each file only keeps its position in them. The
+  * producers never wait for readers and overwrite the oldest data, so a file
+  * that falls a whole ring behind resynchronizes and counts what it lost.
+  */
+ struct xserve_fp_client {
+     struct xserve_fp *dev;
+     struct mutex mmap_mutex;        /* serializes ring creation */
+     struct xserve_fp_ring *ring;    /* event ring, once mapped */
+ 
+     struct mutex read_mutex;        /* serializes streaming read() on this file */
+     unsigned long in_tail;          /* next bulk-IN ring byte this file reads */
+     struct mutex ev_mutex;          /* serializes READ_EVENTS on this file */
+     unsigned int ev_tail;           /* next ev_queue record this file reads */
+ 
+     u32 ev_mask;                    /* XSERVE_FP_EV_MASK() bits of the types delivered */
+     u32 flags;                      /* XSERVE_FP_CLIENT_* */
+ 
+     struct usb_anchor out_anchor;   /* write chunks this file has in flight */
+     int out_error;                  /* URB error reported on next write, fsync or close */
+ 
+     /* See struct xserve_fp_client_info */
+     u64 in_bytes;
+     u64 in_overruns;
+     u64 in_lost_bytes;
+     u64 events;
+     u64 events_lost;
+ };
+ 
+ /* A zero-copy write in flight, cancelled on timeout and by disconnect */
+ struct xserve_fp_sg_write {
+     struct usb_sg_request io;
+     struct delayed_work timeout;
+     struct list_head node;          /* on dev->sg_writes */
+     bool timed_out;
  };
  
  /* Forward declarations for file operations */
@@ -65,7 +609,11 @@
                                size_t count, loff_t *ppos);
  static ssize_t xserve_fp_write(struct file *file, const char __user *user_buffer,
                                 size_t count, loff_t *ppos);
+ static int xserve_fp_flush(struct file *file, fl_owner_t id);
+ static int xserve_fp_fsync(struct file *file, loff_t start, loff_t end, int datasync);
  static long xserve_fp_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+ static __poll_t xserve_fp_poll(struct file *file, poll_table *wait);
+ static int xserve_fp_mmap(struct file *file, struct vm_area_struct *vma);
  
  /* File operations for the character device interface */
  static const struct file_operations xserve_fp_fops = {
@@ -74,7 +622,11 @@
      .write          = xserve_fp_write,
      .open           = xserve_fp_open,
      .release        = xserve_fp_release,
+     .flush          = xserve_fp_flush,
+     .fsync          = xserve_fp_fsync,
      .unlocked_ioctl = xserve_fp_ioctl,
+     .poll           = xserve_fp_poll,
+     .mmap           = xserve_fp_mmap,
  };
  
  /* USB class driver info to register a minor number and create a device node */
@@ -84,305 +636,3247 @@
      .minor_base = XSERVE_FP_MINOR_BASE,
  };
  
- /* Interrupt URB callback function */
- static void xserve_fp_irq(struct urb *urb)
+ /* Every URB goes out through here, so the submit tracepoint sees all of them */
+ static int xserve_fp_submit_urb(struct urb *urb, gfp_t mem_flags)
  {
-     struct xserve_fp *dev = urb->context;
+     struct xserve_fp_urb *ctx = urb->context;
+     /* A submitted URB may complete and be reused before we trace it */
+     unsigned int pipe = urb->pipe;
+     u8 devnum = urb->dev->devnum;
+     u32 len = urb->transfer_buffer_length;
      int retval;
  
-     if (urb->status) {
-         dev_err(&dev->interface->dev,
-                 "Interrupt URB error: %d\n", urb->status);
-         return;
-     }
- 
-     /* Process the interrupt data from dev->irq_buffer.
-      * For example, you might parse event codes or update internal state.
-      */
-     dev_info(&dev->interface->dev,
-              "Interrupt received: first byte = 0x%02x\n", dev->irq_buffer[0]);
- 
-     /* Resubmit the interrupt URB for continuous monitoring */
-     retval = usb_submit_urb(urb, GFP_ATOMIC);
-     if (retval)
-         dev_err(&dev->interface->dev,
-                 "Failed to resubmit interrupt URB: %d\n", retval);
+     ctx->submit_ns = ktime_get_ns();
+     retval = usb_submit_urb(urb, mem_flags);
+     trace_xserve_fp_urb_submit(urb, devnum, pipe, len, retval);
+     return retval;
  }
  
- /* Probe function: Called when a matching device is plugged in */
- static int xserve_fp_probe(struct usb_interface *interface,
-                            const struct usb_device_id *id)
+ /* Histogram bucket of a duration: 0 for under 1 us, else 1 + log2(us) */
+ static unsigned int xserve_fp_hist_bucket(u64 ns)
  {
-     struct usb_device *udev = interface_to_usbdev(interface);
-     struct xserve_fp *dev;
-     struct usb_host_interface *iface_desc;
-     struct usb_endpoint_descriptor *endpoint;
-     int i, retval = -ENOMEM;
- 
-     /* Allocate and initialize our device structure */
-     dev = kzalloc(sizeof(*dev), GFP_KERNEL);
-     if (!dev) {
-         dev_err(&interface->dev, "Out of memory\n");
-         goto error;
-     }
-     dev->udev = usb_get_dev(udev);
-     dev->interface = interface;
-     mutex_init(&dev->io_mutex);
-     dev->bulk_in_endpointAddr = 0;
-     dev->bulk_out_endpointAddr = 0;
-     dev->irq_endpointAddr = 0;
-     dev->irq_buffer = NULL;
-     dev->irq_urb = NULL;
+     return min_t(unsigned int, fls64(div_u64(ns, NSEC_PER_USEC)),
+                  XSERVE_FP_HIST_BUCKETS - 1);
+ }
  
-     iface_desc = interface->cur_altsetting;
-     /* Loop through endpoints and identify bulk and interrupt endpoints */
-     for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
-         endpoint = &iface_desc->endpoint[i].desc;
-         if (usb_endpoint_is_bulk_in(endpoint)) {
-             dev->bulk_in_size = usb_endpoint_maxp(endpoint);
-             dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
-             dev->bulk_in_buffer = kmalloc(dev->bulk_in_size, GFP_KERNEL);
-             if (!dev->bulk_in_buffer) {
-                 dev_err(&interface->dev, "Could not allocate bulk_in_buffer\n");
-                 goto error;
-             }
-         } else if (usb_endpoint_is_bulk_out(endpoint)) {
-             dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
-         } else if (usb_endpoint_is_int_in(endpoint)) {
-             dev->irq_buffer_size = usb_endpoint_maxp(endpoint);
-             dev->irq_endpointAddr = endpoint->bEndpointAddress;
-             dev->irq_buffer = kmalloc(dev->irq_buffer_size, GFP_KERNEL);
-             if (!dev->irq_buffer) {
-                 dev_err(&interface->dev, "Could not allocate irq_buffer\n");
-                 goto error;
-             }
-         }
-     }
+ /* Account one finished transfer; callable from any context */
+ static void xserve_fp_stat_xfer(struct xserve_fp *dev, unsigned int ep, int status,
+                                 u32 bytes, u64 start_ns)
+ {
+     struct xserve_fp_ep_stats __percpu *s = &dev->stats->ep[ep];
+     int err = -status;
  
-     if (!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr)) {
-         dev_err(&interface->dev,
-                 "Could not find both bulk-in and bulk-out endpoints\n");
-         retval = -ENODEV;
-         goto error;
-     }
+     this_cpu_inc(s->xfers);
+     this_cpu_add(s->bytes, bytes);
+     if (status)
+         this_cpu_inc(s->errors[err > 0 && err < XSERVE_FP_STAT_ERRNOS ? err : 0]);
+     this_cpu_inc(s->latency[xserve_fp_hist_bucket(ktime_get_ns() - start_ns)]);
+ }
  
-     usb_set_intfdata(interface, dev);
+ /* Account a completed URB, from its callback */
+ static void xserve_fp_stat_urb(struct xserve_fp *dev, unsigned int ep,
+                                const struct urb *urb)
+ {
+     const struct xserve_fp_urb *ctx = urb->context;
  
-     /* Register the device to get a minor number and create a /dev node */
-     retval = usb_register_dev(interface, &xserve_fp_class);
-     if (retval) {
-         dev_err(&interface->dev,
-                 "Not able to get a minor for this device.\n");
-         usb_set_intfdata(interface, NULL);
-         goto error;
-     }
+     xserve_fp_stat_xfer(dev, ep, urb->status, urb->actual_length, ctx->submit_ns);
+ }
  
-     /* Set up and submit the interrupt URB if an interrupt endpoint is available */
-     if (dev->irq_buffer && dev->irq_endpointAddr) {
-         dev->irq_urb = usb_alloc_urb(0, GFP_KERNEL);
-         if (!dev->irq_urb) {
-             dev_err(&interface->dev, "Could not allocate interrupt URB\n");
-             retval = -ENOMEM;
-             goto error;
-         }
-         usb_fill_int_urb(dev->irq_urb,
-                          dev->udev,
-                          usb_rcvintpipe(dev->udev, dev->irq_endpointAddr),
-                          dev->irq_buffer,
-                          dev->irq_buffer_size,
-                          xserve_fp_irq,
-                          dev,
-                          iface_desc->desc.bInterval);
-         retval = usb_submit_urb(dev->irq_urb, GFP_KERNEL);
-         if (retval) {
-             dev_err(&interface->dev, "Failed to submit interrupt URB: %d\n", retval);
-             usb_free_urb(dev->irq_urb);
-             dev->irq_urb = NULL;
-             /* Depending on your needs, you might continue without interrupt support */
-         }
-     }
+ /* mutex_lock_interruptible() that records how long the caller waited */
+ static int xserve_fp_lock_timed(struct xserve_fp *dev, struct mutex *lock,
+                                 unsigned int which)
+ {
+     u64 start = ktime_get_ns();
  
-     dev_info(&interface->dev,
-              "Apple Xserve Front Panel USB device now attached as /dev/xserve_fp%d\n",
-              interface->minor);
+     if (mutex_lock_interruptible(lock))
+         return -ERESTARTSYS;
+     this_cpu_inc(dev->stats->lock_wait[which][xserve_fp_hist_bucket(ktime_get_ns() - start)]);
      return 0;
- 
- error:
-     if (dev) {
-         if (dev->irq_urb)
-             usb_free_urb(dev->irq_urb);
-         kfree(dev->bulk_in_buffer);
-         kfree(dev->irq_buffer);
-     }
-     kfree(dev);
-     return retval;
  }
  
- /* Disconnect function: Called when the device is unplugged */
- static void xserve_fp_disconnect(struct usb_interface *interface)
+ /* Is an event of this type in a client's XSERVE_FP_EV_MASK() set? */
+ static bool xserve_fp_ev_wanted(u32 mask, unsigned int type)
  {
-     struct xserve_fp *dev = usb_get_intfdata(interface);
+     if (type >= 32)
+         return mask == XSERVE_FP_EV_MASK_ALL;
+     return mask & XSERVE_FP_EV_MASK(type);
+ }
  
-     usb_set_intfdata(interface, NULL);
-     usb_deregister_dev(interface, &xserve_fp_class);
-     dev_info(&interface->dev, "Apple Xserve Front Panel USB device now disconnected\n");
+ /* Copy one event into a mapped ring. Called with ev_rings_lock held. */
+ static void xserve_fp_ring_put(struct xserve_fp_ring *ring,
+                                const struct xserve_fp_event *ev)
+ {
+     unsigned int head = ring->head;
+     /* Userspace owns tail; a bogus value only makes the ring look full */
+     unsigned int tail = smp_load_acquire(&ring->hdr->tail);
  
-     if (dev->irq_urb) {
-         usb_kill_urb(dev->irq_urb);
-         usb_free_urb(dev->irq_urb);
+     if (head - tail >= ring->size) {
+         WRITE_ONCE(ring->hdr->overflows, ring->hdr->overflows + 1);
+         return;
      }
-     usb_put_dev(dev->udev);
-     kfree(dev->bulk_in_buffer);
-     kfree(dev->irq_buffer);
-     kfree(dev);
+ 
+     ring->records[head & (ring->size - 1)] = *ev;
+     ring->head = head + 1;
+     smp_store_release(&ring->hdr->head, ring->head);
  }
  
- /* File operation: open
-  *
-  * Locate the device structure based on the minor number.
-  */
- static int xserve_fp_open(struct inode *inode, struct file *file)
+ /* Decode a raw report; unknown and short reports decode as XSERVE_FP_EV_RAW */
+ static void xserve_fp_decode(const struct xserve_fp *dev, const unsigned char *data,
+                              unsigned int len, struct xserve_fp_report *rep)
  {
-     struct usb_interface *interface;
-     struct xserve_fp *dev;
-     int subminor = iminor(inode);
+     const struct xserve_fp_report_desc *d = dev->report_map[data[0]];
+     unsigned int i;
  
-     interface = usb_find_interface(&xserve_fp_driver, subminor);
-     if (!interface)
-         return -ENODEV;
+     rep->type = XSERVE_FP_EV_RAW;
+     rep->code = 0;
+     rep->value = 0;
+     if (!d || len < d->min_len)
+         return;
  
-     dev = usb_get_intfdata(interface);
-     if (!dev)
-         return -ENODEV;
+     rep->type = d->type;
+     if (d->code_off)
+         rep->code = data[d->code_off];
+     for (i = 0; i < d->value_len; ++i)
+         rep->value |= (u32)data[d->value_off + i] << (8 * i);
+ }
  
-     file->private_data = dev;
-     return 0;
+ /* Index the protocol's descriptors by report id. Called from probe. */
+ static void xserve_fp_decoder_init(struct xserve_fp *dev,
+                                    const struct xserve_fp_protocol *proto)
+ {
+     const struct xserve_fp_report_desc *d;
+     unsigned int i;
+ 
+     for (i = 0; i < proto->nr_reports; ++i) {
+         d = &proto->reports[i];
+         /* The decoder trusts min_len to cover every byte it reads */
+         if (WARN_ON(d->value_len > 4 || d->min_len <= d->code_off ||
+                     d->min_len < d->value_off + d->value_len))
+             continue;
+         dev->report_map[d->id] = d;
+     }
  }
  
- /* File operation: release */
- static int xserve_fp_release(struct inode *inode, struct file *file)
+ /* Report a button change to evdev. Called from the interrupt URB callback. */
+ static void xserve_fp_input_report(struct xserve_fp *dev, const struct xserve_fp_report *rep)
  {
-     return 0;
+     struct input_dev *input = dev->input;
+ 
+     if (!input || rep->code >= input->keycodemax)
+         return;
+     input_event(input, EV_MSC, MSC_SCAN, rep->code);
+     input_report_key(input, dev->keymap[rep->code], rep->value != 0);
+     input_sync(input);
  }
  
- /* File operation: read
-  *
-  * Reads data from the device via a bulk IN transfer.
-  */
- static ssize_t xserve_fp_read(struct file *file, char __user *buffer,
-                               size_t count, loff_t *ppos)
+ /* Register the panel buttons as an input device. Called from probe. */
+ static int xserve_fp_input_init(struct xserve_fp *dev,
+                                 const struct xserve_fp_protocol *proto)
  {
-     struct xserve_fp *dev = file->private_data;
+     struct input_dev *input;
+     unsigned int i;
      int retval;
-     int bytes_read;
  
-     if (mutex_lock_interruptible(&dev->io_mutex))
-         return -ERESTARTSYS;
+     input = input_allocate_device();
+     if (!input)
+         return -ENOMEM;
  
-     retval = usb_bulk_msg(dev->udev,
-                           usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-                           dev->bulk_in_buffer,
-                           min(dev->bulk_in_size, count),
-                           &bytes_read,
-                           5000);
-     mutex_unlock(&dev->io_mutex);
+     usb_make_path(dev->udev, dev->input_phys, sizeof(dev->input_phys));
+     strlcat(dev->input_phys, "/input0", sizeof(dev->input_phys));
+     input->name = "Apple Xserve Front Panel";
+     input->phys = dev->input_phys;
+     usb_to_input_id(dev->udev, &input->id);
+     input->dev.parent = &dev->interface->dev;
  
-     if (retval)
-         return retval;
+     /* A private copy, so EVIOCSKEYCODE remaps this device only */
+     memcpy(dev->keymap, proto->keymap, proto->nr_keys * sizeof(*dev->keymap));
+     input->keycode = dev->keymap;
+     input->keycodesize = sizeof(*dev->keymap);
+     input->keycodemax = proto->nr_keys;
  
-     if (copy_to_user(buffer, dev->bulk_in_buffer, bytes_read))
-         return -EFAULT;
-     return bytes_read;
+     __set_bit(EV_KEY, input->evbit);
+     __set_bit(EV_MSC, input->evbit);
+     __set_bit(MSC_SCAN, input->mscbit);
+     for (i = 0; i < proto->nr_keys; ++i)
+         __set_bit(dev->keymap[i], input->keybit);
+     __clear_bit(KEY_RESERVED, input->keybit);
+     input_set_drvdata(input, dev);
+ 
+     retval = input_register_device(input);
+     if (retval) {
+         input_free_device(input);
+         return retval;
+     }
+     dev->input = input;
+     return 0;
  }
  
- /* File operation: write
-  *
-  * Writes data to the device via a bulk OUT transfer.
+ /*
+  * Open a write section of the status page. The sequence count is odd until
+  * xserve_fp_spage_end(), so lockless readers retry instead of seeing a torn
+  * snapshot.
   */
- static ssize_t xserve_fp_write(struct file *file, const char __user *user_buffer,
-                                size_t count, loff_t *ppos)
+ static struct xserve_fp_status_page *xserve_fp_spage_begin(struct xserve_fp *dev,
+                                                           unsigned long *flags)
  {
-     struct xserve_fp *dev = file->private_data;
-     int retval;
-     int bytes_written;
-     char *buf;
+     struct xserve_fp_status_page *p = dev->spage;
  
-     buf = kmalloc(count, GFP_KERNEL);
-     if (!buf)
-         return -ENOMEM;
+     spin_lock_irqsave(&dev->spage_lock, *flags);
+     WRITE_ONCE(p->seq, p->seq + 1);
+     smp_wmb();
+     return p;
+ }
  
-     if (copy_from_user(buf, user_buffer, count)) {
-         kfree(buf);
-         return -EFAULT;
-     }
+ static void xserve_fp_spage_end(struct xserve_fp *dev, unsigned long flags)
+ {
+     struct xserve_fp_status_page *p = dev->spage;
  
-     if (mutex_lock_interruptible(&dev->io_mutex)) {
-         kfree(buf);
+     p->update_ns = ktime_get_ns();
+     smp_wmb();
+     WRITE_ONCE(p->seq, p->seq + 1);
+     spin_unlock_irqrestore(&dev->spage_lock, flags);
+ }
+ 
+ /* Queue one interrupt report. Called from the interrupt URB callback with irq_lock held. */
+ static void xserve_fp_event_put(struct xserve_fp *dev, const struct xserve_fp_report *rep,
+                                 const unsigned char *data, unsigned int len)
+ {
+     unsigned int head = dev->ev_head;
+     struct xserve_fp_status_page *p;
+     struct xserve_fp_ring *ring;
+     struct xserve_fp_event ev;
+     unsigned long flags;
+ 
+     ev.timestamp_ns = ktime_get_ns();
+     /* Records a reader loses to overwriting show up as gaps */
+     ev.seq = dev->ev_seq++;
+     ev.type = rep->type;
+     ev.code = rep->code;
+     ev.value = rep->value;
+     ev.len = min_t(unsigned int, len, XSERVE_FP_EVENT_DATA);
+     memcpy(ev.data, data, ev.len);
+     memset(ev.data + ev.len, 0, XSERVE_FP_EVENT_DATA - ev.len);
+ 
+     /*
+      * Readers copy a record and then check ev_head to see whether it was
+      * overwritten meanwhile, so the last head must be visible before the
+      * oldest slot is reused.
+      */
+     smp_wmb();
+     dev->ev_queue[head & (XSERVE_FP_EVENT_QUEUE - 1)] = ev;
+     /* Publish the record before the new head */
+     smp_store_release(&dev->ev_head, head + 1);
+ 
+     spin_lock(&dev->ev_rings_lock);
+     list_for_each_entry(ring, &dev->ev_rings, node) {
+         if (xserve_fp_ev_wanted(READ_ONCE(ring->client->ev_mask), ev.type))
+             xserve_fp_ring_put(ring, &ev);
+     }
+     spin_unlock(&dev->ev_rings_lock);
+ 
+     p = xserve_fp_spage_begin(dev, &flags);
+     p->events = dev->ev_seq;
+     xserve_fp_spage_end(dev, flags);
+ 
+     wake_up_interruptible(&dev->ev_wait);
+ }
+ 
+ /* Store a status word reported by the device */
+ static void xserve_fp_status_store(struct xserve_fp *dev, u32 status, bool pushed)
+ {
+     struct xserve_fp_status_page *p;
+     unsigned long flags;
+     u64 now = ktime_get_ns();
+ 
+     spin_lock_irqsave(&dev->status_lock, flags);
+     dev->status = status;
+     dev->status_stamp_ns = now;
+     if (pushed)
+         dev->status_pushed = true;
+     spin_unlock_irqrestore(&dev->status_lock, flags);
+ 
+     p = xserve_fp_spage_begin(dev, &flags);
+     p->status = status;
+     p->status_ns = now;
+     xserve_fp_spage_end(dev, flags);
+ }
+ 
+ /* Leave a failed interrupt URB parked and schedule recovery. Called with irq_lock held. */
+ static void xserve_fp_irq_fault(struct xserve_fp *dev, int status)
+ {
+     struct xserve_fp_status_page *p;
+     unsigned long flags;
+ 
+     dev->irq_errors++;
+     p = xserve_fp_spage_begin(dev, &flags);
+     p->irq_errors = dev->irq_errors;
+     xserve_fp_spage_end(dev, flags);
+     if (status == -EPIPE) {
+         dev->irq_stalls++;
+         dev->irq_stalled = true;
+     }
+     if (!dev->irq_recovering) {
+         dev->irq_recovering = true;
+         dev->irq_fault_ns = ktime_get_ns();
+         dev->irq_backoff_ms = XSERVE_FP_IRQ_BACKOFF_MIN;
+     }
+     /* Only a report from a restarted URB ends the episode */
+     dev->irq_restarted = false;
+     /* A pending attempt restarts every URB, this one included */
+     schedule_delayed_work(&dev->irq_work, msecs_to_jiffies(dev->irq_backoff_ms));
+ }
+ 
+ /* First good report after irq_work restarted the endpoint. Called with irq_lock held. */
+ static void xserve_fp_irq_recovered(struct xserve_fp *dev)
+ {
+     u64 t = ktime_get_ns() - dev->irq_fault_ns;
+ 
+     dev->irq_recovering = false;
+     dev->irq_restarted = false;
+     dev->irq_recoveries++;
+     dev->irq_recover_last_ns = t;
+     dev->irq_recover_max_ns = max(dev->irq_recover_max_ns, t);
+ }
+ 
+ /* Interrupt URB callback function */
+ static void xserve_fp_irq(struct urb *urb)
+ {
+     struct xserve_fp_urb *ctx = urb->context;
+     struct xserve_fp *dev = ctx->dev;
+     unsigned char *data = urb->transfer_buffer;
+     struct xserve_fp_report rep;
+     int retval;
+ 
+     trace_xserve_fp_urb_complete(urb);
+     xserve_fp_stat_urb(dev, XSERVE_FP_EP_INT, urb);
+     switch (urb->status) {
+     case 0:
+         break;
+     case -ENOENT:
+     case -ECONNRESET:
+     case -ESHUTDOWN:
+         /* Killed by disconnect or by the recovery work */
+         return;
+     default:
+         /*
+          * A stall (-EPIPE) needs a clear-halt; -EPROTO, -EILSEQ and the like
+          * are usually transient. Either way the work item restarts the
+          * endpoint, so one error no longer silences it for good.
+          */
+         dev_err_ratelimited(&dev->interface->dev,
+                             "Interrupt URB error: %d\n", urb->status);
+         spin_lock(&dev->irq_lock);
+         xserve_fp_irq_fault(dev, urb->status);
+         spin_unlock(&dev->irq_lock);
+         return;
+     }
+ 
+     spin_lock(&dev->irq_lock);
+     /* A URB that was never parked says nothing about the recovery */
+     if (unlikely(dev->irq_recovering) && dev->irq_restarted)
+         xserve_fp_irq_recovered(dev);
+     if (urb->actual_length) {
+         /* Decoded once; every consumer below works on rep */
+         xserve_fp_decode(dev, data, urb->actual_length, &rep);
+ 
+         /* Hand the report to userspace; nothing is logged on the hot path */
+         xserve_fp_event_put(dev, &rep, data, urb->actual_length);
+ 
+         /* Status reports keep the GET_STATUS cache fresh without USB traffic */
+         if (rep.type == XSERVE_FP_EV_STATUS)
+             xserve_fp_status_store(dev, rep.value, true);
+         else if (rep.type == XSERVE_FP_EV_BUTTON)
+             xserve_fp_input_report(dev, &rep);
+     }
+     spin_unlock(&dev->irq_lock);
+ 
+     /* Resubmit the interrupt URB; the others covered the endpoint meanwhile */
+     usb_anchor_urb(urb, &dev->irq_anchor);
+     retval = xserve_fp_submit_urb(urb, GFP_ATOMIC);
+     if (retval) {
+         usb_unanchor_urb(urb);
+         dev_err_ratelimited(&dev->interface->dev,
+                             "Failed to resubmit interrupt URB: %d\n", retval);
+         /* Parked like a failed completion, so irq_work brings it back */
+         spin_lock(&dev->irq_lock);
+         xserve_fp_irq_fault(dev, retval);
+         spin_unlock(&dev->irq_lock);
+     }
+ }
+ 
+ /* Allocate the interrupt URBs, each with its own buffer. Called from probe. */
+ static int xserve_fp_irq_alloc(struct xserve_fp *dev)
+ {
+     unsigned char *buf;
+     struct urb *urb;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_IRQ_URBS; ++i) {
+         urb = usb_alloc_urb(0, GFP_KERNEL);
+         if (!urb)
+             return -ENOMEM;
+         buf = usb_alloc_coherent(dev->udev, dev->irq_buffer_size, GFP_KERNEL,
+                                  &urb->transfer_dma);
+         if (!buf) {
+             usb_free_urb(urb);
+             return -ENOMEM;
+         }
+         usb_fill_int_urb(urb,
+                          dev->udev,
+                          usb_rcvintpipe(dev->udev, dev->irq_endpointAddr),
+                          buf,
+                          dev->irq_buffer_size,
+                          xserve_fp_irq,
+                          &dev->irq_ctx[i],
+                          dev->irq_interval);
+         urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+         dev->irq_ctx[i].dev = dev;
+         dev->irq_urbs[i] = urb;
+     }
+     return 0;
+ }
+ 
+ static void xserve_fp_irq_free(struct xserve_fp *dev)
+ {
+     struct urb *urb;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_IRQ_URBS; ++i) {
+         urb = dev->irq_urbs[i];
+         if (!urb)
+             continue;
+         usb_free_coherent(dev->udev, dev->irq_buffer_size,
+                           urb->transfer_buffer, urb->transfer_dma);
+         usb_free_urb(urb);
+         dev->irq_urbs[i] = NULL;
+     }
+ }
+ 
+ /* Queue every interrupt URB. Called from probe. */
+ static int xserve_fp_irq_start(struct xserve_fp *dev)
+ {
+     int i, retval;
+ 
+     for (i = 0; i < XSERVE_FP_IRQ_URBS; ++i) {
+         usb_anchor_urb(dev->irq_urbs[i], &dev->irq_anchor);
+         retval = xserve_fp_submit_urb(dev->irq_urbs[i], GFP_KERNEL);
+         if (retval) {
+             usb_unanchor_urb(dev->irq_urbs[i]);
+             usb_kill_anchored_urbs(&dev->irq_anchor);
+             return retval;
+         }
+     }
+     return 0;
+ }
+ 
+ /*
+  * Delayed work: restart the interrupt endpoint after an error. Every URB is
+  * killed first, since none may be queued across a clear-halt, then the halt
+  * is cleared if the endpoint stalled and all URBs are resubmitted.
+  */
+ static void xserve_fp_irq_work(struct work_struct *work)
+ {
+     struct xserve_fp *dev = container_of(to_delayed_work(work),
+                                          struct xserve_fp, irq_work);
+     bool stalled;
+     int retval = 0;
+ 
+     if (READ_ONCE(dev->disconnected))
+         return;
+ 
+     usb_kill_anchored_urbs(&dev->irq_anchor);
+ 
+     spin_lock_irq(&dev->irq_lock);
+     stalled = dev->irq_stalled;
+     dev->irq_stalled = false;
+     /* Every URB is dead, so the next report comes from a resubmitted one */
+     dev->irq_restarted = true;
+     /* The next attempt of this episode waits twice as long */
+     dev->irq_backoff_ms = min_t(unsigned int, 2 * dev->irq_backoff_ms,
+                                 XSERVE_FP_IRQ_BACKOFF_MAX);
+     spin_unlock_irq(&dev->irq_lock);
+ 
+     if (stalled)
+         retval = usb_clear_halt(dev->udev,
+                                 usb_rcvintpipe(dev->udev, dev->irq_endpointAddr));
+     if (!retval)
+         retval = xserve_fp_irq_start(dev);
+     if (!retval)
+         return;
+ 
+     dev_err_ratelimited(&dev->interface->dev,
+                         "Interrupt endpoint recovery failed: %d\n", retval);
+     spin_lock_irq(&dev->irq_lock);
+     dev->irq_restarted = false;
+     if (stalled)
+         dev->irq_stalled = true;
+     schedule_delayed_work(&dev->irq_work, msecs_to_jiffies(dev->irq_backoff_ms));
+     spin_unlock_irq(&dev->irq_lock);
+ }
+ 
+ /* Submit every bulk-IN URB */
+ static int xserve_fp_in_submit(struct xserve_fp *dev)
+ {
+     int i, retval;
+ 
+     for (i = 0; i < XSERVE_FP_IN_URBS; ++i) {
+         usb_anchor_urb(dev->in_urbs[i], &dev->in_anchor);
+         retval = xserve_fp_submit_urb(dev->in_urbs[i], GFP_KERNEL);
+         if (retval) {
+             usb_unanchor_urb(dev->in_urbs[i]);
+             usb_kill_anchored_urbs(&dev->in_anchor);
+             return retval;
+         }
+     }
+     return 0;
+ }
+ 
+ /*
+  * Start the bulk-IN stream for the first opener, clearing a halt left by an
+  * earlier one. Called with open_mutex held.
+  */
+ static int xserve_fp_in_start(struct xserve_fp *dev)
+ {
+     bool stalled;
+     int retval = 0;
+ 
+     spin_lock_irq(&dev->in_lock);
+     dev->in_error = 0;
+     dev->in_running = true;
+     dev->in_recovering = false;
+     stalled = dev->in_stalled;
+     dev->in_stalled = false;
+     spin_unlock_irq(&dev->in_lock);
+ 
+     if (stalled)
+         retval = usb_clear_halt(dev->udev,
+                                 usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+     if (!retval)
+         retval = xserve_fp_in_submit(dev);
+     if (retval) {
+         spin_lock_irq(&dev->in_lock);
+         dev->in_running = false;
+         dev->in_stalled = stalled;
+         spin_unlock_irq(&dev->in_lock);
+         dev_err(&dev->interface->dev,
+                 "Failed to start bulk-IN stream: %d\n", retval);
+     }
+     return retval;
+ }
+ 
+ /* Stop the bulk-IN stream and its recovery. Called by the last closer. */
+ static void xserve_fp_in_stop(struct xserve_fp *dev)
+ {
+     spin_lock_irq(&dev->in_lock);
+     dev->in_running = false;
+     spin_unlock_irq(&dev->in_lock);
+     /* Failures schedule nothing from now on, so the work cannot come back */
+     cancel_delayed_work_sync(&dev->in_work);
+     usb_kill_anchored_urbs(&dev->in_anchor);
+ }
+ 
+ /* Park a failed bulk-IN URB and schedule recovery. Called with in_lock held. */
+ static void xserve_fp_in_fault(struct xserve_fp *dev, int status)
+ {
+     if (!dev->in_running)
+         return;
+     if (status == -EPIPE)
+         dev->in_stalled = true;
+     if (!dev->in_recovering) {
+         dev->in_recovering = true;
+         dev->in_backoff_ms = XSERVE_FP_IN_BACKOFF_MIN;
+     }
+     /* A pending attempt restarts every URB, this one included */
+     schedule_delayed_work(&dev->in_work, msecs_to_jiffies(dev->in_backoff_ms));
+ }
+ 
+ /* Restart the bulk-IN stream after an error, clearing a halt first */
+ static void xserve_fp_in_work(struct work_struct *work)
+ {
+     struct xserve_fp *dev = container_of(to_delayed_work(work),
+                                          struct xserve_fp, in_work);
+     bool stalled;
+     int retval = 0;
+ 
+     if (READ_ONCE(dev->disconnected))
+         return;
+ 
+     usb_kill_anchored_urbs(&dev->in_anchor);
+ 
+     spin_lock_irq(&dev->in_lock);
+     if (!dev->in_running) {
+         spin_unlock_irq(&dev->in_lock);
+         return;
+     }
+     stalled = dev->in_stalled;
+     dev->in_stalled = false;
+     /* The next attempt of this episode waits twice as long */
+     dev->in_backoff_ms = min_t(unsigned int, 2 * dev->in_backoff_ms,
+                                XSERVE_FP_IN_BACKOFF_MAX);
+     spin_unlock_irq(&dev->in_lock);
+ 
+     if (stalled)
+         retval = usb_clear_halt(dev->udev,
+                                 usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+     if (!retval)
+         retval = xserve_fp_in_submit(dev);
+     if (!retval)
+         return;
+ 
+     dev_err_ratelimited(&dev->interface->dev,
+                         "Bulk-IN endpoint recovery failed: %d\n", retval);
+     spin_lock_irq(&dev->in_lock);
+     if (stalled)
+         dev->in_stalled = true;
+     if (dev->in_running)
+         schedule_delayed_work(&dev->in_work, msecs_to_jiffies(dev->in_backoff_ms));
+     spin_unlock_irq(&dev->in_lock);
+ }
+ 
+ /*
+  * Copy a completed bulk-IN transfer into the ring, over the oldest data.
+  * Called with in_lock held. Readers never hold the producer back; see
+  * xserve_fp_read_stream() for how they detect data overwritten under them.
+  */
+ static void xserve_fp_in_ring_put(struct xserve_fp *dev,
+                                   const unsigned char *data, size_t len)
+ {
+     unsigned long head = dev->in_head;
+     size_t off, first;
+ 
+     /* Make the last head visible before reusing the oldest bytes */
+     smp_wmb();
+     off = head & (dev->in_ring_size - 1);
+     first = min_t(size_t, len, dev->in_ring_size - off);
+     memcpy(dev->in_ring + off, data, first);
+     memcpy(dev->in_ring, data + first, len - first);
+ 
+     /* Publish the data before the new head */
+     smp_store_release(&dev->in_head, head + len);
+ }
+ 
+ /* Bulk-IN URB callback: feed the ring and keep the URB in flight */
+ static void xserve_fp_in_complete(struct urb *urb)
+ {
+     struct xserve_fp_urb *ctx = urb->context;
+     struct xserve_fp *dev = ctx->dev;
+     unsigned long flags;
+     int retval;
+ 
+     trace_xserve_fp_urb_complete(urb);
+     xserve_fp_stat_urb(dev, XSERVE_FP_EP_BULK_IN, urb);
+     switch (urb->status) {
+     case 0:
+         break;
+     case -ENOENT:
+     case -ECONNRESET:
+     case -ESHUTDOWN:
+         /* Killed by release or disconnect */
+         return;
+     default:
+         /* Parked; in_work restarts the stream after a backoff */
+         spin_lock_irqsave(&dev->in_lock, flags);
+         dev->in_error = urb->status;
+         xserve_fp_in_fault(dev, urb->status);
+         spin_unlock_irqrestore(&dev->in_lock, flags);
+         wake_up_interruptible(&dev->in_wait);
+         return;
+     }
+ 
+     spin_lock_irqsave(&dev->in_lock, flags);
+     /* The endpoint works again; the next error starts a new episode */
+     dev->in_recovering = false;
+     if (urb->actual_length)
+         xserve_fp_in_ring_put(dev, urb->transfer_buffer, urb->actual_length);
+     spin_unlock_irqrestore(&dev->in_lock, flags);
+     if (urb->actual_length)
+         wake_up_interruptible(&dev->in_wait);
+ 
+     usb_anchor_urb(urb, &dev->in_anchor);
+     retval = xserve_fp_submit_urb(urb, GFP_ATOMIC);
+     if (retval) {
+         usb_unanchor_urb(urb);
+         dev_err_ratelimited(&dev->interface->dev,
+                             "Failed to resubmit bulk-IN URB: %d\n", retval);
+         /* Parked like a failed completion, so in_work brings it back */
+         spin_lock_irqsave(&dev->in_lock, flags);
+         xserve_fp_in_fault(dev, retval);
+         spin_unlock_irqrestore(&dev->in_lock, flags);
+     }
+ }
+ 
+ /* Allocate the bulk-IN URB pool and its ring. Called from probe. */
+ static int xserve_fp_in_alloc(struct xserve_fp *dev)
+ {
+     unsigned char *buf;
+     struct urb *urb;
+     int i;
+ 
+     /* Room for several rounds of completions before a reader must run */
+     dev->in_ring_size = roundup_pow_of_two(max_t(size_t, XSERVE_FP_IN_RING_MIN,
+                                                  4 * XSERVE_FP_IN_URBS * dev->bulk_in_size));
+     dev->in_ring = vmalloc(dev->in_ring_size);
+     if (!dev->in_ring)
+         return -ENOMEM;
+ 
+     for (i = 0; i < XSERVE_FP_IN_URBS; ++i) {
+         urb = usb_alloc_urb(0, GFP_KERNEL);
+         if (!urb)
+             return -ENOMEM;
+         buf = usb_alloc_coherent(dev->udev, dev->bulk_in_size, GFP_KERNEL,
+                                  &urb->transfer_dma);
+         if (!buf) {
+             usb_free_urb(urb);
+             return -ENOMEM;
+         }
+         usb_fill_bulk_urb(urb,
+                           dev->udev,
+                           usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                           buf,
+                           dev->bulk_in_size,
+                           xserve_fp_in_complete,
+                           &dev->in_ctx[i]);
+         urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+         dev->in_ctx[i].dev = dev;
+         dev->in_urbs[i] = urb;
+     }
+     return 0;
+ }
+ 
+ static void xserve_fp_in_free(struct xserve_fp *dev)
+ {
+     struct urb *urb;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_IN_URBS; ++i) {
+         urb = dev->in_urbs[i];
+         if (!urb)
+             continue;
+         usb_free_coherent(dev->udev, urb->transfer_buffer_length,
+                           urb->transfer_buffer, urb->transfer_dma);
+         usb_free_urb(urb);
+         dev->in_urbs[i] = NULL;
+     }
+     vfree(dev->in_ring);
+     dev->in_ring = NULL;
+ }
+ 
+ /*
+  * Bulk-OUT URB callback: latch any error on the file that queued the URB and
+  * return the URB to the pool
+  */
+ static void xserve_fp_write_complete(struct urb *urb)
+ {
+     struct xserve_fp_out_urb *ctx = container_of(urb->context,
+                                                  struct xserve_fp_out_urb, ctx);
+     struct xserve_fp *dev = ctx->ctx.dev;
+     unsigned long flags;
+ 
+     trace_xserve_fp_urb_complete(urb);
+     xserve_fp_stat_urb(dev, XSERVE_FP_EP_BULK_OUT, urb);
+     if (urb->status &&
+         !(urb->status == -ENOENT ||
+           urb->status == -ECONNRESET ||
+           urb->status == -ESHUTDOWN))
+         dev_err_ratelimited(&dev->interface->dev,
+                             "Bulk-OUT URB error: %d\n", urb->status);
+ 
+     spin_lock_irqsave(&dev->out_lock, flags);
+     if (urb->status)
+         ctx->client->out_error = urb->status;
+     dev->out_free[dev->out_nfree++] = urb;
+     spin_unlock_irqrestore(&dev->out_lock, flags);
+     up(&dev->limit_sem);
+     /* Zero-copy writes wait uninterruptibly for the pool to go idle */
+     wake_up(&dev->out_wait);
+ }
+ 
+ /* Allocate the bulk-OUT URB pool. Called from probe. */
+ static int xserve_fp_out_alloc(struct xserve_fp *dev)
+ {
+     unsigned char *buf;
+     struct urb *urb;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_OUT_URBS; ++i) {
+         urb = usb_alloc_urb(0, GFP_KERNEL);
+         if (!urb)
+             return -ENOMEM;
+         buf = usb_alloc_coherent(dev->udev, XSERVE_FP_OUT_BUFSIZE, GFP_KERNEL,
+                                  &urb->transfer_dma);
+         if (!buf) {
+             usb_free_urb(urb);
+             return -ENOMEM;
+         }
+         usb_fill_bulk_urb(urb,
+                           dev->udev,
+                           usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+                           buf,
+                           XSERVE_FP_OUT_BUFSIZE,
+                           xserve_fp_write_complete,
+                           &dev->out_ctx[i].ctx);
+         urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+         dev->out_ctx[i].ctx.dev = dev;
+         dev->out_urbs[i] = urb;
+         dev->out_free[dev->out_nfree++] = urb;
+     }
+     return 0;
+ }
+ 
+ static void xserve_fp_out_free(struct xserve_fp *dev)
+ {
+     struct urb *urb;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_OUT_URBS; ++i) {
+         urb = dev->out_urbs[i];
+         if (!urb)
+             continue;
+         usb_free_coherent(dev->udev, XSERVE_FP_OUT_BUFSIZE,
+                           urb->transfer_buffer, urb->transfer_dma);
+         usb_free_urb(urb);
+         dev->out_urbs[i] = NULL;
+     }
+     dev->out_nfree = 0;
+ }
+ 
+ /* Fetch and clear the bulk-OUT error latched on a file, if any */
+ static int xserve_fp_out_error(struct xserve_fp_client *client)
+ {
+     struct xserve_fp *dev = client->dev;
+     int retval;
+ 
+     spin_lock_irq(&dev->out_lock);
+     retval = client->out_error;
+     client->out_error = 0;
+     spin_unlock_irq(&dev->out_lock);
+ 
+     /* Preserve notifications about a stall, everything else is an I/O error */
+     if (retval && retval != -EPIPE)
+         retval = -EIO;
+     return retval;
+ }
+ 
+ /*
+  * Wait for the writes a file queued to complete, killing them if the device
+  * is stuck. Other files' writes are neither waited for nor killed.
+  */
+ static int xserve_fp_out_drain(struct xserve_fp_client *client)
+ {
+     if (!usb_wait_anchor_empty_timeout(&client->out_anchor, XSERVE_FP_OUT_TIMEOUT))
+         usb_kill_anchored_urbs(&client->out_anchor);
+     return xserve_fp_out_error(client);
+ }
+ 
+ /* Return a control slot to the pool */
+ static void xserve_fp_ctrl_put(struct xserve_fp *dev, struct xserve_fp_ctrl *c)
+ {
+     unsigned long flags;
+ 
+     spin_lock_irqsave(&dev->ctrl_lock, flags);
+     dev->ctrl_free[dev->ctrl_nfree++] = c;
+     spin_unlock_irqrestore(&dev->ctrl_lock, flags);
+     up(&dev->ctrl_sem);
+ }
+ 
+ /* Take an idle control slot, sleeping for one unless nonblock */
+ static struct xserve_fp_ctrl *xserve_fp_ctrl_get(struct xserve_fp *dev, bool nonblock)
+ {
+     struct xserve_fp_ctrl *c;
+ 
+     if (nonblock) {
+         if (down_trylock(&dev->ctrl_sem))
+             return ERR_PTR(-EAGAIN);
+     } else if (down_interruptible(&dev->ctrl_sem)) {
+         return ERR_PTR(-ERESTARTSYS);
+     }
+ 
+     spin_lock_irq(&dev->ctrl_lock);
+     c = dev->ctrl_free[--dev->ctrl_nfree];
+     spin_unlock_irq(&dev->ctrl_lock);
+     return c;
+ }
+ 
+ /* Control URB callback: wake the waiter, or recycle a detached slot */
+ static void xserve_fp_ctrl_complete(struct urb *urb)
+ {
+     struct xserve_fp_ctrl *c = urb->context;
+     struct xserve_fp *dev = c->ctx.dev;
+     unsigned long flags;
+ 
+     trace_xserve_fp_urb_complete(urb);
+     xserve_fp_stat_urb(dev, XSERVE_FP_EP_CTRL, urb);
+     c->status = urb->status ? urb->status : urb->actual_length;
+     if (!c->detached) {
+         complete(&c->done);
+         return;
+     }
+ 
+     if (urb->status) {
+         spin_lock_irqsave(&dev->ctrl_lock, flags);
+         dev->ctrl_errors++;
+         spin_unlock_irqrestore(&dev->ctrl_lock, flags);
+         if (!(urb->status == -ENOENT ||
+               urb->status == -ECONNRESET ||
+               urb->status == -ESHUTDOWN))
+             dev_err_ratelimited(&dev->interface->dev,
+                                 "Control request %#x failed: %d\n",
+                                 c->setup->bRequest, urb->status);
+     }
+     xserve_fp_ctrl_put(dev, c);
+     up(&dev->ctrl_detached_sem);
+ }
+ 
+ /*
+  * Queue a vendor request on a slot. For OUT requests the data stage must
+  * already be in c->buf. A detached slot goes back to the pool by itself and
+  * must not be touched once this returns 0; otherwise reap the request with
+  * xserve_fp_ctrl_wait(). On failure the caller still owns the slot.
+  * Detached requests have no timeout, so the caller first takes
+  * ctrl_detached_sem: a wedged endpoint 0 then holds at most
+  * XSERVE_FP_CTRL_DETACHED slots and the waiting callers keep the rest.
+  * Needs no lock: after disconnect poisons ctrl_anchor every submission fails.
+  */
+ static int xserve_fp_ctrl_submit(struct xserve_fp_ctrl *c, u8 request, bool in,
+                                  u16 value, u16 index, u16 len, bool detached)
+ {
+     struct xserve_fp *dev = c->ctx.dev;
+     int retval;
+ 
+     if (READ_ONCE(dev->disconnected))
+         return -ENODEV;
+ 
+     c->setup->bRequestType = (in ? USB_DIR_IN : USB_DIR_OUT) |
+                              USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+     c->setup->bRequest = request;
+     c->setup->wValue = cpu_to_le16(value);
+     c->setup->wIndex = cpu_to_le16(index);
+     c->setup->wLength = cpu_to_le16(len);
+     c->urb->pipe = in ? usb_rcvctrlpipe(dev->udev, 0) : usb_sndctrlpipe(dev->udev, 0);
+     c->urb->transfer_buffer_length = len;
+     c->detached = detached;
+     reinit_completion(&c->done);
+ 
+     usb_anchor_urb(c->urb, &dev->ctrl_anchor);
+     retval = xserve_fp_submit_urb(c->urb, GFP_KERNEL);
+     if (retval)
+         usb_unanchor_urb(c->urb);
+     return retval;
+ }
+ 
+ /* Wait for a queued request, killing it after timeout ms; returns bytes or -errno */
+ static int xserve_fp_ctrl_wait(struct xserve_fp_ctrl *c, unsigned int timeout)
+ {
+     if (!wait_for_completion_timeout(&c->done, msecs_to_jiffies(timeout))) {
+         usb_kill_urb(c->urb);
+         wait_for_completion(&c->done);
+         /* Report the timeout rather than the kill, as usb_control_msg() does */
+         if (c->status == -ENOENT)
+             c->status = -ETIMEDOUT;
+     }
+     return c->status;
+ }
+ 
+ /*
+  * Synchronous vendor request through the pool, a drop-in for usb_control_msg()
+  * that needs no DMA-safe buffer from the caller. len is at most
+  * XSERVE_FP_CTRL_BUFSIZE. Returns bytes transferred or -errno.
+  */
+ static int xserve_fp_ctrl_msg(struct xserve_fp *dev, u8 request, bool in,
+                               u16 value, u16 index, void *data, u16 len)
+ {
+     struct xserve_fp_ctrl *c;
+     int retval;
+ 
+     c = xserve_fp_ctrl_get(dev, false);
+     if (IS_ERR(c))
+         return PTR_ERR(c);
+ 
+     if (!in && len)
+         memcpy(c->buf, data, len);
+     retval = xserve_fp_ctrl_submit(c, request, in, value, index, len, false);
+     if (!retval) {
+         retval = xserve_fp_ctrl_wait(c, XSERVE_FP_CTRL_TIMEOUT);
+         if (in && retval > 0)
+             memcpy(data, c->buf, retval);
+     }
+     xserve_fp_ctrl_put(dev, c);
+     return retval;
+ }
+ 
+ /*
+  * A window of control requests in flight, reaped in submission order. Lets a
+  * caller keep several requests on endpoint 0 at once without owning the
+  * whole pool.
+  */
+ struct xserve_fp_ctrl_pipe {
+     struct xserve_fp *dev;
+     struct xserve_fp_ctrl *slots[XSERVE_FP_CTRL_URBS];
+     unsigned int first;
+     unsigned int count;
+     void (*reap)(struct xserve_fp_ctrl *c, void *ctx);  /* once per finished request */
+     void *ctx;
+ };
+ 
+ static void xserve_fp_pipe_reap_one(struct xserve_fp_ctrl_pipe *pipe)
+ {
+     struct xserve_fp_ctrl *c = pipe->slots[pipe->first];
+ 
+     pipe->first = (pipe->first + 1) % XSERVE_FP_CTRL_URBS;
+     pipe->count--;
+     xserve_fp_ctrl_wait(c, XSERVE_FP_CTRL_TIMEOUT);
+     pipe->reap(c, pipe->ctx);
+     xserve_fp_ctrl_put(pipe->dev, c);
+ }
+ 
+ /*
+  * Get a slot for the next request of a pipeline. A pipeline never sleeps for
+  * a slot while it holds some: it reaps its own oldest request instead, so
+  * concurrent pipelines cannot starve each other of the pool.
+  */
+ static struct xserve_fp_ctrl *xserve_fp_pipe_get(struct xserve_fp_ctrl_pipe *pipe)
+ {
+     struct xserve_fp_ctrl *c;
+ 
+     for (;;) {
+         c = xserve_fp_ctrl_get(pipe->dev, pipe->count > 0);
+         if (!IS_ERR(c) || PTR_ERR(c) != -EAGAIN)
+             return c;
+         xserve_fp_pipe_reap_one(pipe);
+     }
+ }
+ 
+ /* Track a request submitted on a slot from xserve_fp_pipe_get() */
+ static void xserve_fp_pipe_push(struct xserve_fp_ctrl_pipe *pipe,
+                                 struct xserve_fp_ctrl *c)
+ {
+     pipe->slots[(pipe->first + pipe->count) % XSERVE_FP_CTRL_URBS] = c;
+     pipe->count++;
+ }
+ 
+ static void xserve_fp_pipe_drain(struct xserve_fp_ctrl_pipe *pipe)
+ {
+     while (pipe->count)
+         xserve_fp_pipe_reap_one(pipe);
+ }
+ 
+ /* Allocate the control URB pool. Called from probe. */
+ static int xserve_fp_ctrl_alloc(struct xserve_fp *dev)
+ {
+     struct xserve_fp_ctrl *c;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_CTRL_URBS; ++i) {
+         c = &dev->ctrl[i];
+         c->ctx.dev = dev;
+         init_completion(&c->done);
+         c->urb = usb_alloc_urb(0, GFP_KERNEL);
+         c->setup = kmalloc(sizeof(*c->setup), GFP_KERNEL);
+         if (!c->urb || !c->setup)
+             return -ENOMEM;
+         c->buf = usb_alloc_coherent(dev->udev, XSERVE_FP_CTRL_BUFSIZE, GFP_KERNEL,
+                                     &c->urb->transfer_dma);
+         if (!c->buf)
+             return -ENOMEM;
+         usb_fill_control_urb(c->urb,
+                              dev->udev,
+                              usb_sndctrlpipe(dev->udev, 0),
+                              (unsigned char *)c->setup,
+                              c->buf,
+                              0,
+                              xserve_fp_ctrl_complete,
+                              c);
+         c->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+         dev->ctrl_free[dev->ctrl_nfree++] = c;
+     }
+     return 0;
+ }
+ 
+ static void xserve_fp_ctrl_free(struct xserve_fp *dev)
+ {
+     struct xserve_fp_ctrl *c;
+     int i;
+ 
+     for (i = 0; i < XSERVE_FP_CTRL_URBS; ++i) {
+         c = &dev->ctrl[i];
+         if (c->buf)
+             usb_free_coherent(dev->udev, XSERVE_FP_CTRL_BUFSIZE,
+                               c->buf, c->urb->transfer_dma);
+         usb_free_urb(c->urb);
+         kfree(c->setup);
+         c->buf = NULL;
+         c->urb = NULL;
+         c->setup = NULL;
+     }
+     dev->ctrl_nfree = 0;
+ }
+ 
+ /*
+  * Record a value the device acknowledged. An update made while the value
+  * was in flight may have been cancelled against the older led_hw, so an
+  * LED whose shadow no longer matches is marked dirty again; returns true
+  * if that happened and a flush is needed.
+  */
+ static bool xserve_fp_led_acked(struct xserve_fp *dev, unsigned int led, u8 val)
+ {
+     bool dirty;
+ 
+     spin_lock_irq(&dev->led_lock);
+     dev->led_hw[led] = val;
+     set_bit(led, dev->led_hw_valid);
+     dirty = dev->led_shadow[led] != val;
+     if (dirty)
+         set_bit(led, dev->led_dirty);
+     spin_unlock_irq(&dev->led_lock);
+     return dirty;
+ }
+ 
+ /* Retry an LED on the next flush; a newer shadow value is sent instead */
+ static void xserve_fp_led_retry(struct xserve_fp *dev, unsigned int led, int err)
+ {
+     spin_lock_irq(&dev->led_lock);
+     set_bit(led, dev->led_dirty);
+     spin_unlock_irq(&dev->led_lock);
+     dev_err_ratelimited(&dev->interface->dev,
+                         "Failed to set LED %u: %d\n", led, err);
+ }
+ 
+ /* Kick the flush worker, no sooner than led_flush_ms after the last flush */
+ static void xserve_fp_led_schedule(struct xserve_fp *dev)
+ {
+     unsigned long next = dev->led_last_flush + msecs_to_jiffies(READ_ONCE(led_flush_ms));
+ 
+     /* A pending flush already covers this update */
+     schedule_delayed_work(&dev->led_work,
+                           time_after(next, jiffies) ? next - jiffies : 0);
+ }
+ 
+ /* Send one LED value to the device and wait for it */
+ static int xserve_fp_led_send(struct xserve_fp *dev, unsigned int led, u8 val)
+ {
+     int retval;
+ 
+     retval = xserve_fp_ctrl_msg(dev, XSERVE_FP_REQ_SET_LED, false, val, led, NULL, 0);
+     if (retval < 0)
+         return retval;
+ 
+     if (xserve_fp_led_acked(dev, led, val))
+         xserve_fp_led_schedule(dev);
+     return 0;
+ }
+ 
+ /* Update the shadow of one LED; returns true if the device needs the value */
+ static bool xserve_fp_led_update(struct xserve_fp *dev, unsigned int led, u8 val)
+ {
+     struct xserve_fp_status_page *p;
+     unsigned long flags;
+     bool dirty;
+ 
+     spin_lock_irq(&dev->led_lock);
+     /* Published in shadow order, so the page never lags behind a newer value */
+     if (dev->led_shadow[led] != val) {
+         p = xserve_fp_spage_begin(dev, &flags);
+         p->leds[led] = val;
+         xserve_fp_spage_end(dev, flags);
+     }
+     dev->led_shadow[led] = val;
+     /* Setting an LED back to what the device shows cancels the update */
+     dirty = !test_bit(led, dev->led_hw_valid) || dev->led_hw[led] != val;
+     if (dirty)
+         set_bit(led, dev->led_dirty);
+     else
+         clear_bit(led, dev->led_dirty);
+     spin_unlock_irq(&dev->led_lock);
+     return dirty;
+ }
+ 
+ /* Pipeline reap callback of the flush worker */
+ static void xserve_fp_led_reap(struct xserve_fp_ctrl *c, void *ctx)
+ {
+     struct xserve_fp *dev = ctx;
+ 
+     if (c->status < 0)
+         xserve_fp_led_retry(dev, c->cookie, c->status);
+     else
+         xserve_fp_led_acked(dev, c->cookie, le16_to_cpu(c->setup->wValue));
+ }
+ 
+ /*
+  * Delayed work: send every LED whose shadow differs from the device. The
+  * requests are pipelined on endpoint 0 rather than sent one round trip at
+  * a time.
+  */
+ static void xserve_fp_led_work(struct work_struct *work)
+ {
+     struct xserve_fp *dev = container_of(to_delayed_work(work),
+                                          struct xserve_fp, led_work);
+     struct xserve_fp_ctrl_pipe pipe = {
+         .dev  = dev,
+         .reap = xserve_fp_led_reap,
+         .ctx  = dev,
+     };
+     DECLARE_BITMAP(dirty, XSERVE_FP_NUM_LEDS);
+     u8 vals[XSERVE_FP_NUM_LEDS];
+     struct xserve_fp_ctrl *c;
+     unsigned int led;
+     bool retry = false;
+     int retval;
+     int idx;
+ 
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected))
+         goto out;
+ 
+     mutex_lock(&dev->led_mutex);
+     spin_lock_irq(&dev->led_lock);
+     bitmap_copy(dirty, dev->led_dirty, XSERVE_FP_NUM_LEDS);
+     bitmap_zero(dev->led_dirty, XSERVE_FP_NUM_LEDS);
+     memcpy(vals, dev->led_shadow, sizeof(vals));
+     spin_unlock_irq(&dev->led_lock);
+ 
+     for_each_set_bit(led, dirty, XSERVE_FP_NUM_LEDS) {
+         c = xserve_fp_pipe_get(&pipe);
+         if (IS_ERR(c)) {
+             xserve_fp_led_retry(dev, led, PTR_ERR(c));
+             continue;
+         }
+         c->cookie = led;
+         retval = xserve_fp_ctrl_submit(c, XSERVE_FP_REQ_SET_LED, false,
+                                        vals[led], led, 0, false);
+         if (retval) {
+             xserve_fp_ctrl_put(dev, c);
+             xserve_fp_led_retry(dev, led, retval);
+             continue;
+         }
+         xserve_fp_pipe_push(&pipe, c);
+     }
+     xserve_fp_pipe_drain(&pipe);
+     dev->led_last_flush = jiffies;
+ 
+     spin_lock_irq(&dev->led_lock);
+     retry = !bitmap_empty(dev->led_dirty, XSERVE_FP_NUM_LEDS);
+     spin_unlock_irq(&dev->led_lock);
+     if (retry)
+         xserve_fp_led_schedule(dev);
+     mutex_unlock(&dev->led_mutex);
+ out:
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+ }
+ 
+ /*
+  * Set one LED. By default only the shadow is updated and the flush worker
+  * sends it; XSERVE_FP_LED_WRITE_THROUGH sends it now and returns the result.
+  * Called inside a disconnect_srcu read section.
+  */
+ static int xserve_fp_led_set(struct xserve_fp *dev, unsigned int led, u8 val,
+                              u32 flags)
+ {
+     int retval = 0;
+ 
+     if (!(flags & XSERVE_FP_LED_WRITE_THROUGH)) {
+         if (xserve_fp_led_update(dev, led, val))
+             xserve_fp_led_schedule(dev);
+         return 0;
+     }
+ 
+     /* led_mutex keeps a concurrent flush from overtaking this value */
+     if (mutex_lock_interruptible(&dev->led_mutex))
+         return -ERESTARTSYS;
+     xserve_fp_led_update(dev, led, val);
+     spin_lock_irq(&dev->led_lock);
+     clear_bit(led, dev->led_dirty);
+     spin_unlock_irq(&dev->led_lock);
+     retval = xserve_fp_led_send(dev, led, val);
+     mutex_unlock(&dev->led_mutex);
+     return retval;
+ }
+ 
+ /* Level of the playing keyframe, elapsed ns into its dur ns */
+ static u8 xserve_fp_player_level(const struct xserve_fp_player *p, u64 elapsed, u64 dur)
+ {
+     const struct xserve_fp_keyframe *k = &p->keys[p->key];
+     int delta = k->brightness - p->from;
+     unsigned int q;
+ 
+     if (k->easing == XSERVE_FP_EASE_STEP)
+         return k->brightness;
+     q = div64_u64(elapsed * 255, dur);
+     return p->from + DIV_ROUND_CLOSEST(delta * xserve_fp_ease[k->easing][q], 255);
+ }
+ 
+ /*
+  * hrtimer of a player, in softirq context. Keyframes that ended since the
+  * last tick are skipped, so a late tick never replays the past.
+  */
+ static enum hrtimer_restart xserve_fp_player_tick(struct hrtimer *t)
+ {
+     struct xserve_fp_player *p = container_of(t, struct xserve_fp_player, timer);
+     u64 frame = (u64)max(READ_ONCE(led_flush_ms), 1U) * NSEC_PER_MSEC;
+     enum hrtimer_restart ret = HRTIMER_RESTART;
+     const struct xserve_fp_keyframe *k;
+     ktime_t now = ktime_get();
+     unsigned long flags;
+     u64 elapsed, dur;
+     u8 level;
+ 
+     spin_lock_irqsave(&p->lock, flags);
+     if (!p->count) {
+         spin_unlock_irqrestore(&p->lock, flags);
+         return HRTIMER_NORESTART;
+     }
+     for (;;) {
+         k = &p->keys[p->key];
+         dur = (u64)k->duration_ms * NSEC_PER_MSEC;
+         elapsed = ktime_to_ns(ktime_sub(now, p->key_start));
+         if (elapsed < dur)
+             break;
+         /* The next keyframe fades from this one's target */
+         p->from = k->brightness;
+         p->key_start = ktime_add_ns(p->key_start, dur);
+         if (++p->key < p->count)
+             continue;
+         p->key = 0;
+         if (p->repeat && !--p->repeat) {
+             p->count = 0;
+             break;
+         }
+     }
+ 
+     if (!p->count) {
+         /* The last pass ends on its final target */
+         level = p->from;
+         ret = HRTIMER_NORESTART;
+     } else {
+         level = xserve_fp_player_level(p, elapsed, dur);
+         /* A step or a hold cannot change before the next keyframe */
+         if (k->easing == XSERVE_FP_EASE_STEP || k->brightness == p->from)
+             hrtimer_set_expires(t, ktime_add_ns(p->key_start, dur));
+         else
+             hrtimer_set_expires(t, ktime_add_ns(now, min(frame, dur - elapsed)));
+     }
+     if (p->gamma)
+         level = xserve_fp_gamma[level];
+     spin_unlock_irqrestore(&p->lock, flags);
+ 
+     if (level != p->out) {
+         p->out = level;
+         if (xserve_fp_led_update(p->dev, p->led, level))
+             xserve_fp_led_schedule(p->dev);
+     }
+     return ret;
+ }
+ 
+ /*
+  * Replace what a player runs. The old animation is stopped before anything
+  * of it is overwritten, so no step of it can follow the new one. Does not
+  * sleep.
+  */
+ static void xserve_fp_player_start(struct xserve_fp_player *p,
+                                    const struct xserve_fp_keyframe *keys,
+                                    unsigned int count, unsigned int repeat, bool gamma)
+ {
+     u8 shown = READ_ONCE(p->dev->led_shadow[p->led]);
+     unsigned long flags;
+ 
+     hrtimer_cancel(&p->timer);
+     spin_lock_irqsave(&p->lock, flags);
+     memcpy(p->keys, keys, count * sizeof(*keys));
+     p->count = count;
+     p->key = 0;
+     p->repeat = repeat;
+     p->gamma = gamma;
+     /* Fade in from what the LED shows now, as a level before gamma */
+     p->from = shown;
+     if (gamma)
+         for (p->from = 0; p->from < 255 && xserve_fp_gamma[p->from] < shown; p->from++)
+             ;
+     p->key_start = ktime_get();
+     p->out = -1;
+     spin_unlock_irqrestore(&p->lock, flags);
+     hrtimer_start(&p->timer, 0, HRTIMER_MODE_REL_SOFT);
+ }
+ 
+ /* Stop a player; the LED keeps its last output */
+ static void xserve_fp_player_stop(struct xserve_fp_player *p)
+ {
+     unsigned long flags;
+ 
+     hrtimer_cancel(&p->timer);
+     spin_lock_irqsave(&p->lock, flags);
+     p->count = 0;
+     spin_unlock_irqrestore(&p->lock, flags);
+ }
+ 
+ /* led_classdev: set the brightness through the shadow, write-through */
+ static int xserve_fp_led_cdev_set(struct led_classdev *cdev, enum led_brightness value)
+ {
+     struct xserve_fp_led_cdev *led = container_of(cdev, struct xserve_fp_led_cdev, cdev);
+     struct xserve_fp *dev = led->dev;
+     int retval;
+     int idx;
+ 
+     /* Setting a brightness, LED_OFF in particular, ends blinking */
+     xserve_fp_player_stop(&dev->anim[led->index]);
+ 
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected))
+         retval = -ENODEV;
+     else
+         retval = xserve_fp_led_set(dev, led->index, value, XSERVE_FP_LED_WRITE_THROUGH);
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+     return retval;
+ }
+ 
+ /* led_classdev: the shadow, so changes made through ioctls show up too */
+ static enum led_brightness xserve_fp_led_cdev_get(struct led_classdev *cdev)
+ {
+     struct xserve_fp_led_cdev *led = container_of(cdev, struct xserve_fp_led_cdev, cdev);
+ 
+     return READ_ONCE(led->dev->led_shadow[led->index]);
+ }
+ 
+ /*
+  * led_classdev: blink on the player, as two step keyframes. Phases shorter
+  * than led_flush_ms would be coalesced away by the flush worker.
+  */
+ static int xserve_fp_led_cdev_blink(struct led_classdev *cdev,
+                                     unsigned long *delay_on, unsigned long *delay_off)
+ {
+     struct xserve_fp_led_cdev *led = container_of(cdev, struct xserve_fp_led_cdev, cdev);
+     unsigned int min_ms = max(READ_ONCE(led_flush_ms), 1U);
+     struct xserve_fp_keyframe blink[2] = {};
+ 
+     if (!*delay_on && !*delay_off)
+         *delay_on = *delay_off = 500;
+     /* Report the timing actually used */
+     *delay_on = clamp_val(*delay_on, min_ms, UINT_MAX);
+     *delay_off = clamp_val(*delay_off, min_ms, UINT_MAX);
+ 
+     blink[0].brightness = cdev->max_brightness;
+     blink[0].duration_ms = *delay_on;
+     blink[1].brightness = LED_OFF;
+     blink[1].duration_ms = *delay_off;
+     xserve_fp_player_start(&led->dev->anim[led->index], blink, ARRAY_SIZE(blink), 0, false);
+     return 0;
+ }
+ 
+ /* led_classdev: hardware pattern of the pattern trigger, as step keyframes */
+ static int xserve_fp_led_cdev_pattern_set(struct led_classdev *cdev,
+                                           struct led_pattern *pattern, u32 len, int repeat)
+ {
+     struct xserve_fp_led_cdev *led = container_of(cdev, struct xserve_fp_led_cdev, cdev);
+     unsigned int min_ms = max(READ_ONCE(led_flush_ms), 1U);
+     struct xserve_fp_keyframe *keys;
+     u32 i;
+ 
+     if (!len || len > XSERVE_FP_ANIM_MAX_KEYS || !repeat)
+         return -EINVAL;
+     keys = kcalloc(len, sizeof(*keys), GFP_KERNEL);
+     if (!keys)
+         return -ENOMEM;
+     for (i = 0; i < len; ++i) {
+         keys[i].brightness = pattern[i].brightness;
+         keys[i].easing = XSERVE_FP_EASE_STEP;
+         keys[i].duration_ms = max(pattern[i].delta_t, min_ms);
+     }
+     /* The pattern trigger repeats forever with -1, the player with 0 */
+     xserve_fp_player_start(&led->dev->anim[led->index], keys, len,
+                            repeat < 0 ? 0 : repeat, false);
+     kfree(keys);
+     return 0;
+ }
+ 
+ static int xserve_fp_led_cdev_pattern_clear(struct led_classdev *cdev)
+ {
+     struct xserve_fp_led_cdev *led = container_of(cdev, struct xserve_fp_led_cdev, cdev);
+ 
+     xserve_fp_player_stop(&led->dev->anim[led->index]);
+     return 0;
+ }
+ 
+ /* Unregister the LED class devices; no LED callback runs afterwards */
+ static void xserve_fp_leds_exit(struct xserve_fp *dev)
+ {
+     unsigned int i;
+ 
+     for (i = 0; i < XSERVE_FP_NUM_LEDS; ++i) {
+         if (!dev->leds[i].registered)
+             continue;
+         led_classdev_unregister(&dev->leds[i].cdev);
+         xserve_fp_player_stop(&dev->anim[i]);
+         dev->leds[i].registered = false;
+     }
+ }
+ 
+ /*
+  * Register every panel LED as a LED class device, named after the /dev node:
+  * xserve_fpN::indicator and xserve_fpN::cpuB-S. Called from probe once the
+  * minor is known.
+  */
+ static int xserve_fp_leds_init(struct xserve_fp *dev)
+ {
+     int node = dev->minor - XSERVE_FP_MINOR_BASE;
+     struct xserve_fp_led_cdev *led;
+     unsigned int i;
+     int retval;
+ 
+     for (i = 0; i < XSERVE_FP_NUM_LEDS; ++i) {
+         led = &dev->leds[i];
+         led->dev = dev;
+         led->index = i;
+         if (i == XSERVE_FP_LED_ID)
+             snprintf(led->name, sizeof(led->name), "xserve_fp%d::indicator", node);
+         else
+             snprintf(led->name, sizeof(led->name), "xserve_fp%d::cpu%u-%u", node,
+                      (i - 1) / XSERVE_FP_BAR_SEGMENTS, (i - 1) % XSERVE_FP_BAR_SEGMENTS);
+ 
+         led->cdev.name = led->name;
+         led->cdev.max_brightness = XSERVE_FP_LED_MAX;
+         /* Unplugging is normal; a failed final LED_OFF is not an error */
+         led->cdev.flags = LED_HW_PLUGGABLE;
+         led->cdev.brightness_set_blocking = xserve_fp_led_cdev_set;
+         led->cdev.brightness_get = xserve_fp_led_cdev_get;
+         led->cdev.blink_set = xserve_fp_led_cdev_blink;
+         led->cdev.pattern_set = xserve_fp_led_cdev_pattern_set;
+         led->cdev.pattern_clear = xserve_fp_led_cdev_pattern_clear;
+ 
+         retval = led_classdev_register(&dev->interface->dev, &led->cdev);
+         if (retval) {
+             xserve_fp_leds_exit(dev);
+             return retval;
+         }
+         led->registered = true;
+     }
+     return 0;
+ }
+ 
+ /* Busy and total time of one CPU, counted like /proc/stat */
+ static void xserve_fp_cpu_time(unsigned int cpu, struct xserve_fp_cpu_sample *s)
+ {
+     struct kernel_cpustat kcs;
+     u64 idle, iowait;
+ 
+     kcpustat_cpu_fetch(&kcs, cpu);
+     /* kcpustat does not advance while a tickless CPU is idle */
+     idle = get_cpu_idle_time_us(cpu, NULL);
+     idle = idle == -1ULL ? kcs.cpustat[CPUTIME_IDLE] : idle * NSEC_PER_USEC;
+     iowait = get_cpu_iowait_time_us(cpu, NULL);
+     iowait = iowait == -1ULL ? kcs.cpustat[CPUTIME_IOWAIT] : iowait * NSEC_PER_USEC;
+ 
+     s->busy = kcs.cpustat[CPUTIME_USER] + kcs.cpustat[CPUTIME_NICE] +
+               kcs.cpustat[CPUTIME_SYSTEM] + kcs.cpustat[CPUTIME_IRQ] +
+               kcs.cpustat[CPUTIME_SOFTIRQ] + kcs.cpustat[CPUTIME_STEAL];
+     s->total = s->busy + idle + iowait;
+ }
+ 
+ /*
+  * Delayed work of the CPU activity meter. CPUs are split over the bars by
+  * number, the first half on bar 0. Each bar lights as many segments as its
+  * CPUs were busy since the last sample. A steady load touches only the
+  * shadow, so it costs no USB traffic and no flush.
+  */
+ static void xserve_fp_cpu_meter_work(struct work_struct *work)
+ {
+     struct xserve_fp *dev = container_of(to_delayed_work(work),
+                                          struct xserve_fp, cpu_meter_work);
+     u64 busy[XSERVE_FP_NUM_BARS] = {}, total[XSERVE_FP_NUM_BARS] = {};
+     unsigned int ms = READ_ONCE(dev->cpu_meter_ms);
+     struct xserve_fp_cpu_sample now, *prev;
+     unsigned int cpu, bar, seg, lit;
+     bool changed = false;
+ 
+     if (!ms || READ_ONCE(dev->disconnected))
+         return;
+ 
+     for_each_online_cpu(cpu) {
+         prev = &dev->cpu_meter_prev[cpu];
+         xserve_fp_cpu_time(cpu, &now);
+         bar = cpu * XSERVE_FP_NUM_BARS / nr_cpu_ids;
+         /* The first sample of a CPU only sets the baseline */
+         if (prev->total && now.total > prev->total) {
+             busy[bar] += now.busy - prev->busy;
+             total[bar] += now.total - prev->total;
+         }
+         *prev = now;
+     }
+ 
+     for (bar = 0; bar < XSERVE_FP_NUM_BARS; ++bar) {
+         if (!total[bar])
+             continue;
+         lit = DIV64_U64_ROUND_CLOSEST(min(busy[bar], total[bar]) * XSERVE_FP_BAR_SEGMENTS,
+                                       total[bar]);
+         for (seg = 0; seg < XSERVE_FP_BAR_SEGMENTS; ++seg)
+             changed |= xserve_fp_led_update(dev, XSERVE_FP_LED_BAR(bar, seg),
+                                             seg < lit ? XSERVE_FP_LED_MAX : 0);
+     }
+     if (changed)
+         xserve_fp_led_schedule(dev);
+ 
+     schedule_delayed_work(&dev->cpu_meter_work, msecs_to_jiffies(ms));
+ }
+ 
+ /* Start, retime or stop the CPU activity meter; stopping clears the bars */
+ static void xserve_fp_cpu_meter_set(struct xserve_fp *dev, unsigned int ms)
+ {
+     unsigned int bar, seg;
+     bool changed = false;
+ 
+     WRITE_ONCE(dev->cpu_meter_ms, ms);
+     if (ms) {
+         mod_delayed_work(system_wq, &dev->cpu_meter_work, 0);
+         return;
+     }
+ 
+     cancel_delayed_work_sync(&dev->cpu_meter_work);
+     for (bar = 0; bar < XSERVE_FP_NUM_BARS; ++bar)
+         for (seg = 0; seg < XSERVE_FP_BAR_SEGMENTS; ++seg)
+             changed |= xserve_fp_led_update(dev, XSERVE_FP_LED_BAR(bar, seg), 0);
+     if (changed)
+         xserve_fp_led_schedule(dev);
+ }
+ 
+ /* Read the status from the device into the cache. Called inside a disconnect_srcu read section. */
+ static int xserve_fp_status_refresh(struct xserve_fp *dev)
+ {
+     __le32 status;
+     int retval;
+ 
+     if (mutex_lock_interruptible(&dev->status_mutex))
+         return -ERESTARTSYS;
+     /* The pool slot provides the DMA-safe data stage */
+     retval = xserve_fp_ctrl_msg(dev, XSERVE_FP_REQ_GET_STATUS, true, 0, 0,
+                                 &status, sizeof(status));
+     if (retval == sizeof(status)) {
+         xserve_fp_status_store(dev, le32_to_cpu(status), false);
+         retval = 0;
+     } else if (retval >= 0) {
+         retval = -EIO;
+     }
+     mutex_unlock(&dev->status_mutex);
+     return retval;
+ }
+ 
+ /*
+  * Return the device status and its age, from the cache when it is younger
+  * than status_max_age_ms. Called inside a disconnect_srcu read section.
+  */
+ static int xserve_fp_status_get(struct xserve_fp *dev, bool force,
+                                 u32 *status, u64 *age_ns)
+ {
+     u64 max_age = (u64)READ_ONCE(status_max_age_ms) * NSEC_PER_MSEC;
+     u64 now = ktime_get_ns();
+     bool hit;
+     int retval;
+ 
+     spin_lock_irq(&dev->status_lock);
+     hit = !force && dev->status_stamp_ns && now - dev->status_stamp_ns < max_age;
+     if (hit)
+         dev->status_hits++;
+     else
+         dev->status_misses++;
+     spin_unlock_irq(&dev->status_lock);
+ 
+     if (!hit) {
+         retval = xserve_fp_status_refresh(dev);
+         if (retval)
+             return retval;
+     }
+ 
+     spin_lock_irq(&dev->status_lock);
+     *status = dev->status;
+     *age_ns = ktime_get_ns() - dev->status_stamp_ns;
+     spin_unlock_irq(&dev->status_lock);
+     return 0;
+ }
+ 
+ /*
+  * Delayed work: poll the status for devices that do not report it through
+  * the interrupt endpoint, keeping the cache within status_max_age_ms.
+  * Runs while the device is open.
+  */
+ static void xserve_fp_status_work(struct work_struct *work)
+ {
+     struct xserve_fp *dev = container_of(to_delayed_work(work),
+                                          struct xserve_fp, status_work);
+     u64 max_age = (u64)READ_ONCE(status_max_age_ms) * NSEC_PER_MSEC;
+     u64 age;
+     int idx;
+ 
+     if (!max_age || READ_ONCE(dev->status_pushed))
+         return;
+ 
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         srcu_read_unlock(&dev->disconnect_srcu, idx);
+         return;
+     }
+     spin_lock_irq(&dev->status_lock);
+     age = ktime_get_ns() - dev->status_stamp_ns;
+     spin_unlock_irq(&dev->status_lock);
+     /* Skip the transfer if a caller refreshed the cache meanwhile */
+     if (age >= max_age) {
+         /* On failure, retry after a full period rather than spin */
+         xserve_fp_status_refresh(dev);
+         age = 0;
+     }
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+ 
+     schedule_delayed_work(&dev->status_work,
+                           nsecs_to_jiffies(max_age - min(age, max_age)) ?: 1);
+ }
+ 
+ static const char * const xserve_fp_ep_names[XSERVE_FP_NR_EPS] = {
+     [XSERVE_FP_EP_BULK_IN]  = "bulk_in",
+     [XSERVE_FP_EP_BULK_OUT] = "bulk_out",
+     [XSERVE_FP_EP_INT]      = "interrupt",
+     [XSERVE_FP_EP_CTRL]     = "control",
+ };
+ 
+ static const char * const xserve_fp_lock_names[XSERVE_FP_NR_LOCKS] = {
+     [XSERVE_FP_LOCK_IN]  = "in_mutex",
+     [XSERVE_FP_LOCK_OUT] = "out_mutex",
+ };
+ 
+ /* Print the non-empty buckets of a log2 histogram, labelled by lower bound */
+ static void xserve_fp_show_hist(struct seq_file *m, const char *name, const u64 *hist)
+ {
+     unsigned int i;
+ 
+     seq_printf(m, "  %s_us:\n", name);
+     for (i = 0; i < XSERVE_FP_HIST_BUCKETS; ++i) {
+         if (hist[i])
+             seq_printf(m, "    >= %-8llu %llu\n", i ? 1ULL << (i - 1) : 0, hist[i]);
+     }
+ }
+ 
+ /* debugfs stats: the per-CPU counters, summed */
+ static int xserve_fp_debug_stats_show(struct seq_file *m, void *unused)
+ {
+     struct xserve_fp *dev = m->private;
+     const struct xserve_fp_ep_stats *ep;
+     struct xserve_fp_stats *sum;
+     const u64 *src;
+     u64 *dst;
+     int cpu, e, i;
+ 
+     sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+     if (!sum)
+         return -ENOMEM;
+ 
+     /* Every field of struct xserve_fp_stats is a u64 counter */
+     dst = (u64 *)sum;
+     for_each_possible_cpu(cpu) {
+         src = (const u64 *)per_cpu_ptr(dev->stats, cpu);
+         for (i = 0; i < sizeof(*sum) / sizeof(u64); ++i)
+             dst[i] += READ_ONCE(src[i]);
+     }
+ 
+     for (e = 0; e < XSERVE_FP_NR_EPS; ++e) {
+         ep = &sum->ep[e];
+         seq_printf(m, "%s:\n  transfers: %llu\n  bytes: %llu\n  errors:",
+                    xserve_fp_ep_names[e], ep->xfers, ep->bytes);
+         for (i = 1; i < XSERVE_FP_STAT_ERRNOS; ++i) {
+             if (ep->errors[i])
+                 seq_printf(m, " %d:%llu", -i, ep->errors[i]);
+         }
+         if (ep->errors[0])
+             seq_printf(m, " other:%llu", ep->errors[0]);
+         seq_putc(m, '\n');
+         xserve_fp_show_hist(m, "latency", ep->latency);
+     }
+     for (i = 0; i < XSERVE_FP_NR_LOCKS; ++i) {
+         seq_printf(m, "%s:\n", xserve_fp_lock_names[i]);
+         xserve_fp_show_hist(m, "wait", sum->lock_wait[i]);
+     }
+ 
+     kfree(sum);
+     return 0;
+ }
+ DEFINE_SHOW_ATTRIBUTE(xserve_fp_debug_stats);
+ 
+ /* debugfs reset: any write zeroes the statistics */
+ static ssize_t xserve_fp_debug_reset_write(struct file *file, const char __user *buf,
+                                            size_t count, loff_t *ppos)
+ {
+     struct xserve_fp *dev = file->private_data;
+     int cpu;
+ 
+     /* Updates racing with the reset may survive it; fine for statistics */
+     for_each_possible_cpu(cpu)
+         memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct xserve_fp_stats));
+     return count;
+ }
+ 
+ static const struct file_operations xserve_fp_debug_reset_fops = {
+     .owner  = THIS_MODULE,
+     .open   = simple_open,
+     .write  = xserve_fp_debug_reset_write,
+     .llseek = noop_llseek,
+ };
+ 
+ /* Create debugfs/xserve_fp/<interface>/. Failures are not fatal. */
+ static void xserve_fp_debugfs_init(struct xserve_fp *dev)
+ {
+     dev->debugfs = debugfs_create_dir(dev_name(&dev->interface->dev),
+                                       xserve_fp_debugfs_root);
+     debugfs_create_file("stats", 0444, dev->debugfs, dev,
+                         &xserve_fp_debug_stats_fops);
+     debugfs_create_file("reset", 0200, dev->debugfs, dev,
+                         &xserve_fp_debug_reset_fops);
+ }
+ 
+ /*
+  * Free the device with its URBs and buffers. Called when the last reference
+  * is dropped: by disconnect, by the last release() after it, or by a failed
+  * probe. The free functions cope with what probe never allocated.
+  */
+ static void xserve_fp_delete(struct kref *kref)
+ {
+     struct xserve_fp *dev = container_of(kref, struct xserve_fp, kref);
+ 
+     xserve_fp_irq_free(dev);
+     xserve_fp_in_free(dev);
+     xserve_fp_out_free(dev);
+     xserve_fp_ctrl_free(dev);
+     kfree(dev->bulk_in_buffer);
+     kfree(dev->cpu_meter_prev);
+     /* Pages still mapped by a reader stay until it unmaps them */
+     vfree(dev->spage);
+     free_percpu(dev->stats);
+     cleanup_srcu_struct(&dev->disconnect_srcu);
+     usb_put_intf(dev->interface);
+     usb_put_dev(dev->udev);
+     kvfree(dev);
+ }
+ 
+ /* Probe function: Called when a matching device is plugged in */
+ static int xserve_fp_probe(struct usb_interface *interface,
+                            const struct usb_device_id *id)
+ {
+     struct usb_device *udev = interface_to_usbdev(interface);
+     struct xserve_fp *dev;
+     struct usb_host_interface *iface_desc;
+     struct usb_endpoint_descriptor *endpoint;
+     const struct xserve_fp_protocol *proto;
+     int i, retval = -ENOMEM;
+ 
+     /*
+      * Allocate and initialize our device structure. The event queue, the LED
+      * players and class devices make it tens of kilobytes, so fall back to
+      * vmalloc() rather than need a high-order page at hotplug time. Nothing
+      * in it is used for DMA.
+      */
+     dev = kvzalloc(sizeof(*dev), GFP_KERNEL);
+     if (!dev) {
+         dev_err(&interface->dev, "Out of memory\n");
+         return -ENOMEM;
+     }
+     retval = init_srcu_struct(&dev->disconnect_srcu);
+     if (retval) {
+         kvfree(dev);
+         return retval;
+     }
+     /* From here on, the error path frees everything through xserve_fp_delete() */
+     kref_init(&dev->kref);
+     retval = -ENOMEM;
+     dev->udev = usb_get_dev(udev);
+     dev->interface = usb_get_intf(interface);
+     mutex_init(&dev->in_mutex);
+     mutex_init(&dev->open_mutex);
+     init_waitqueue_head(&dev->ev_wait);
+     INIT_LIST_HEAD(&dev->ev_rings);
+     spin_lock_init(&dev->ev_rings_lock);
+     spin_lock_init(&dev->led_lock);
+     mutex_init(&dev->led_mutex);
+     INIT_DELAYED_WORK(&dev->led_work, xserve_fp_led_work);
+     INIT_DELAYED_WORK(&dev->cpu_meter_work, xserve_fp_cpu_meter_work);
+     for (i = 0; i < XSERVE_FP_NUM_LEDS; ++i) {
+         dev->anim[i].dev = dev;
+         dev->anim[i].led = i;
+         spin_lock_init(&dev->anim[i].lock);
+         /* hrtimer_init() is gone from newer kernels */
+ #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+         hrtimer_setup(&dev->anim[i].timer, xserve_fp_player_tick,
+                       CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+ #else
+         hrtimer_init(&dev->anim[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+         dev->anim[i].timer.function = xserve_fp_player_tick;
+ #endif
+     }
+     spin_lock_init(&dev->status_lock);
+     mutex_init(&dev->status_mutex);
+     INIT_DELAYED_WORK(&dev->status_work, xserve_fp_status_work);
+     spin_lock_init(&dev->in_lock);
+     init_waitqueue_head(&dev->in_wait);
+     init_usb_anchor(&dev->in_anchor);
+     init_usb_anchor(&dev->sync_anchor);
+     spin_lock_init(&dev->out_lock);
+     sema_init(&dev->limit_sem, XSERVE_FP_OUT_URBS);
+     mutex_init(&dev->out_mutex);
+     init_waitqueue_head(&dev->out_wait);
+     INIT_LIST_HEAD(&dev->sg_writes);
+     mutex_init(&dev->sg_mutex);
+     init_usb_anchor(&dev->ctrl_anchor);
+     sema_init(&dev->ctrl_sem, XSERVE_FP_CTRL_URBS);
+     sema_init(&dev->ctrl_detached_sem, XSERVE_FP_CTRL_DETACHED);
+     spin_lock_init(&dev->ctrl_lock);
+     dev->bulk_in_endpointAddr = 0;
+     dev->bulk_out_endpointAddr = 0;
+     dev->irq_endpointAddr = 0;
+     dev->stats = alloc_percpu(struct xserve_fp_stats);
+     if (!dev->stats)
+         goto error;
+     /* vmalloc_user() zeroes the page and makes it mappable */
+     BUILD_BUG_ON(XSERVE_FP_NUM_LEDS > sizeof_field(struct xserve_fp_status_page, leds));
+     dev->spage = vmalloc_user(PAGE_SIZE);
+     if (!dev->spage)
+         goto error;
+     spin_lock_init(&dev->spage_lock);
+     dev->cpu_meter_prev = kcalloc(nr_cpu_ids, sizeof(*dev->cpu_meter_prev), GFP_KERNEL);
+     if (!dev->cpu_meter_prev)
+         goto error;
+     init_usb_anchor(&dev->irq_anchor);
+     spin_lock_init(&dev->irq_lock);
+     /* IDs added through new_id carry no driver_info */
+     proto = id->driver_info ? (const struct xserve_fp_protocol *)id->driver_info :
+                               &xserve_fp_protocol;
+     xserve_fp_decoder_init(dev, proto);
+     INIT_DELAYED_WORK(&dev->irq_work, xserve_fp_irq_work);
+     INIT_DELAYED_WORK(&dev->in_work, xserve_fp_in_work);
+ 
+     iface_desc = interface->cur_altsetting;
+     /* Loop through endpoints and identify bulk and interrupt endpoints */
+     for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
+         endpoint = &iface_desc->endpoint[i].desc;
+         if (usb_endpoint_is_bulk_in(endpoint)) {
+             /* Multi-packet transfers: one URB moves many packets */
+             dev->bulk_in_maxp = usb_endpoint_maxp(endpoint);
+             dev->bulk_in_size = clamp_t(size_t, READ_ONCE(bulk_in_xfer_size),
+                                         dev->bulk_in_maxp, XSERVE_FP_IN_XFER_MAX);
+             dev->bulk_in_size = roundup(dev->bulk_in_size, dev->bulk_in_maxp);
+             dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
+         } else if (usb_endpoint_is_bulk_out(endpoint)) {
+             dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
+         } else if (usb_endpoint_is_int_in(endpoint)) {
+             dev->irq_buffer_size = usb_endpoint_maxp(endpoint);
+             dev->irq_endpointAddr = endpoint->bEndpointAddress;
+             dev->irq_interval = endpoint->bInterval;
+         }
+     }
+ 
+     if (!(dev->bulk_in_endpointAddr && dev->bulk_out_endpointAddr)) {
+         dev_err(&interface->dev,
+                 "Could not find both bulk-in and bulk-out endpoints\n");
+         retval = -ENODEV;
+         goto error;
+     }
+ 
+     /* URBs are only put in flight on first open */
+     dev->stream_in = stream_in;
+     if (dev->stream_in) {
+         retval = xserve_fp_in_alloc(dev);
+         if (retval) {
+             dev_err(&interface->dev, "Could not allocate bulk-IN stream\n");
+             goto error;
+         }
+     } else {
+         /*
+          * Only synchronous reads use bulk_in_buffer. It must be physically
+          * contiguous for DMA, so it stays small enough not to fail probe.
+          */
+         dev->bulk_in_size = min_t(size_t, dev->bulk_in_size,
+                                   rounddown(XSERVE_FP_IN_SYNC_MAX, dev->bulk_in_maxp));
+         dev->bulk_in_buffer = kmalloc(dev->bulk_in_size, GFP_KERNEL);
+         if (!dev->bulk_in_buffer) {
+             dev_err(&interface->dev, "Could not allocate bulk_in_buffer\n");
+             retval = -ENOMEM;
+             goto error;
+         }
+     }
+ 
+     retval = xserve_fp_out_alloc(dev);
+     if (retval) {
+         dev_err(&interface->dev, "Could not allocate bulk-OUT URBs\n");
+         goto error;
+     }
+ 
+     retval = xserve_fp_ctrl_alloc(dev);
+     if (retval) {
+         dev_err(&interface->dev, "Could not allocate control URBs\n");
+         goto error;
+     }
+ 
+     if (dev->irq_endpointAddr) {
+         retval = xserve_fp_irq_alloc(dev);
+         if (retval) {
+             dev_err(&interface->dev, "Could not allocate interrupt URBs\n");
+             goto error;
+         }
+ 
+         /* Buttons arrive on the interrupt endpoint; register before it starts */
+         if (proto->nr_keys) {
+             retval = xserve_fp_input_init(dev, proto);
+             if (retval) {
+                 dev_err(&interface->dev, "Could not register input device\n");
+                 goto error;
+             }
+         }
+     }
+ 
+     usb_set_intfdata(interface, dev);
+ 
+     /* Register the device to get a minor number and create a /dev node */
+     retval = usb_register_dev(interface, &xserve_fp_class);
+     if (retval) {
+         dev_err(&interface->dev,
+                 "Not able to get a minor for this device.\n");
+         usb_set_intfdata(interface, NULL);
+         goto error;
+     }
+     dev->minor = interface->minor;
+     retval = xa_insert(&xserve_fp_devs, dev->minor, dev, GFP_KERNEL);
+     if (retval) {
+         usb_deregister_dev(interface, &xserve_fp_class);
+         usb_set_intfdata(interface, NULL);
+         goto error;
+     }
+     xserve_fp_debugfs_init(dev);
+ 
+     /* Like debugfs, the LED class devices are optional */
+     retval = xserve_fp_leds_init(dev);
+     if (retval)
+         dev_warn(&interface->dev, "Failed to register LED class devices: %d\n", retval);
+     if (cpu_meter_ms)
+         xserve_fp_cpu_meter_set(dev, max_t(unsigned int, cpu_meter_ms,
+                                            XSERVE_FP_CPU_METER_MIN_MS));
+ 
+     /* Submit the interrupt URBs if an interrupt endpoint is available */
+     if (dev->irq_endpointAddr) {
+         retval = xserve_fp_irq_start(dev);
+         if (retval)
+             /* Depending on your needs, you might continue without interrupt support */
+             dev_err(&interface->dev, "Failed to submit interrupt URBs: %d\n", retval);
+     }
+ 
+     dev_info(&interface->dev,
+              "Apple Xserve Front Panel USB device now attached as /dev/xserve_fp%d\n",
+              interface->minor);
+     return 0;
+ 
+ error:
+     if (dev->input)
+         input_unregister_device(dev->input);
+     kref_put(&dev->kref, xserve_fp_delete);
+     return retval;
+ }
+ 
+ /* Disconnect function: Called when the device is unplugged */
+ static void xserve_fp_disconnect(struct usb_interface *interface)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(interface);
+     struct xserve_fp_sg_write *w;
+     int i;
+ 
+     /* No open() finds the device from now on; open files keep their reference */
+     xa_erase(&xserve_fp_devs, dev->minor);
+     usb_set_intfdata(interface, NULL);
+     usb_deregister_dev(interface, &xserve_fp_class);
+     debugfs_remove_recursive(dev->debugfs);
+     /* While the device can still be reached, so LED_OFF goes out on unbind */
+     xserve_fp_leds_exit(dev);
+     dev_info(&interface->dev, "Apple Xserve Front Panel USB device now disconnected\n");
+ 
+     /* No section starts using the device after this */
+     WRITE_ONCE(dev->disconnected, true);
+     /* Kills queued control requests and fails any submitted from now on */
+     usb_poison_anchored_urbs(&dev->ctrl_anchor);
+     /* Kills a synchronous read's transfer and fails any submitted from now on */
+     usb_poison_anchored_urbs(&dev->sync_anchor);
+     /* Zero-copy writes wait inside a section; cut them short */
+     mutex_lock(&dev->sg_mutex);
+     list_for_each_entry(w, &dev->sg_writes, node)
+         usb_sg_cancel(&w->io);
+     mutex_unlock(&dev->sg_mutex);
+     /* Wait for the sections in progress; their control requests fail fast now */
+     synchronize_srcu(&dev->disconnect_srcu);
+ 
+     /* The meter and the players feed the LED flush worker */
+     cancel_delayed_work_sync(&dev->cpu_meter_work);
+     for (i = 0; i < XSERVE_FP_NUM_LEDS; ++i)
+         xserve_fp_player_stop(&dev->anim[i]);
+     cancel_delayed_work_sync(&dev->led_work);
+     cancel_delayed_work_sync(&dev->status_work);
+     /* Poisoned first, so neither a completion nor the work can requeue anything */
+     usb_poison_anchored_urbs(&dev->irq_anchor);
+     cancel_delayed_work_sync(&dev->irq_work);
+     /* No report can arrive any more */
+     if (dev->input)
+         input_unregister_device(dev->input);
+     /* Poisoned, so a late release() or completion cannot restart them */
+     usb_poison_anchored_urbs(&dev->in_anchor);
+     cancel_delayed_work_sync(&dev->in_work);
+     /* Write chunks are anchored per file; poison the whole pool */
+     for (i = 0; i < XSERVE_FP_OUT_URBS; ++i)
+         usb_poison_urb(dev->out_urbs[i]);
+     wake_up_interruptible_all(&dev->in_wait);
+     wake_up_interruptible_all(&dev->out_wait);
+     wake_up_interruptible_all(&dev->ev_wait);
+     /* Open files keep the memory until their last release() */
+     kref_put(&dev->kref, xserve_fp_delete);
+ }
+ 
+ /* File operation: open
+  *
+  * Locate the device structure based on the minor number.
+  */
+ static int xserve_fp_open(struct inode *inode, struct file *file)
+ {
+     struct xserve_fp_client *client;
+     struct xserve_fp *dev;
+     int retval = 0;
+     int idx;
+ 
+     /* Disconnect erases the entry before dropping its reference */
+     xa_lock(&xserve_fp_devs);
+     dev = xa_load(&xserve_fp_devs, iminor(inode));
+     if (dev)
+         kref_get(&dev->kref);
+     xa_unlock(&xserve_fp_devs);
+     if (!dev)
+         return -ENODEV;
+ 
+     client = kzalloc(sizeof(*client), GFP_KERNEL);
+     if (!client) {
+         retval = -ENOMEM;
+         goto out_put;
+     }
+     client->dev = dev;
+     mutex_init(&client->mmap_mutex);
+     mutex_init(&client->read_mutex);
+     mutex_init(&client->ev_mutex);
+     init_usb_anchor(&client->out_anchor);
+     client->ev_mask = XSERVE_FP_EV_MASK_ALL;
+ 
+     if (mutex_lock_interruptible(&dev->open_mutex)) {
+         retval = -ERESTARTSYS;
+         goto out_put;
+     }
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         retval = -ENODEV;
+         goto out;
+     }
+     /* The first opener starts the bulk-IN stream and the status poller */
+     if (dev->open_count == 0 && dev->stream_in) {
+         retval = xserve_fp_in_start(dev);
+         if (retval)
+             goto out;
+     }
+     if (dev->open_count == 0)
+         schedule_delayed_work(&dev->status_work, 0);
+     dev->open_count++;
+     /* A new file sees only data and events that arrive after it opened */
+     client->in_tail = smp_load_acquire(&dev->in_head);
+     client->ev_tail = smp_load_acquire(&dev->ev_head);
+     file->private_data = client;
+ out:
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+     mutex_unlock(&dev->open_mutex);
+ out_put:
+     if (retval) {
+         kfree(client);
+         kref_put(&dev->kref, xserve_fp_delete);
+     }
+     return retval;
+ }
+ 
+ /* File operation: release
+  *
+  * The last closer stops the bulk-IN stream and the status poller.
+  * Runs after the last munmap(), so a mapped event ring can be freed here.
+  * Drops the file's device reference, which frees the device once it is
+  * also disconnected.
+  */
+ static int xserve_fp_release(struct inode *inode, struct file *file)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     struct xserve_fp_ring *ring = client->ring;
+ 
+     if (ring) {
+         spin_lock_irq(&dev->ev_rings_lock);
+         list_del(&ring->node);
+         spin_unlock_irq(&dev->ev_rings_lock);
+         vfree(ring->hdr);
+         kfree(ring);
+     }
+ 
+     mutex_lock(&dev->open_mutex);
+     if (--dev->open_count == 0) {
+         if (dev->stream_in)
+             xserve_fp_in_stop(dev);
+         cancel_delayed_work_sync(&dev->status_work);
+     }
+     mutex_unlock(&dev->open_mutex);
+     /* flush() is skipped when a syscall held the last reference */
+     usb_kill_anchored_urbs(&client->out_anchor);
+     kfree(client);
+     kref_put(&dev->kref, xserve_fp_delete);
+     return 0;
+ }
+ 
+ /* O_NONBLOCK, or XSERVE_FP_CLIENT_NONBLOCK set on the file */
+ static bool xserve_fp_nonblock(struct file *file)
+ {
+     struct xserve_fp_client *client = file->private_data;
+ 
+     return (file->f_flags & O_NONBLOCK) ||
+            (READ_ONCE(client->flags) & XSERVE_FP_CLIENT_NONBLOCK);
+ }
+ 
+ /* Count bulk-IN data a file lost to overwriting. Called with read_mutex held. */
+ static void xserve_fp_in_lost(struct xserve_fp_client *client, unsigned long bytes)
+ {
+     struct xserve_fp *dev = client->dev;
+ 
+     client->in_overruns++;
+     client->in_lost_bytes += bytes;
+     spin_lock_irq(&dev->in_lock);
+     dev->in_overflows++;
+     dev->in_dropped_bytes += bytes;
+     spin_unlock_irq(&dev->in_lock);
+ }
+ 
+ /*
+  * Copy ring data to userspace at this file's cursor, blocking until at least
+  * one byte is available. The copy goes straight from the shared ring: a
+  * completion may be rewriting the bulk_in_size bytes before the oldest data,
+  * so only the rest of the ring is readable, and a copy is kept only if
+  * in_head shows no completion reached it meanwhile.
+  */
+ static ssize_t xserve_fp_read_stream(struct xserve_fp_client *client, char __user *buffer,
+                                      size_t count, bool nonblock)
+ {
+     struct xserve_fp *dev = client->dev;
+     unsigned long window = dev->in_ring_size - dev->bulk_in_size;
+     unsigned long head, tail;
+     size_t n, off, first;
+     int retval;
+ 
+     for (;;) {
+         if (nonblock) {
+             if (!mutex_trylock(&client->read_mutex))
+                 return -EAGAIN;
+         } else if (xserve_fp_lock_timed(dev, &client->read_mutex, XSERVE_FP_LOCK_IN)) {
+             return -ERESTARTSYS;
+         }
+ 
+         head = smp_load_acquire(&dev->in_head);
+         tail = client->in_tail;
+         if (head - tail > window) {
+             xserve_fp_in_lost(client, head - window - tail);
+             tail = head - window;
+             WRITE_ONCE(client->in_tail, tail);
+         }
+         if (head != tail) {
+             n = min_t(size_t, count, head - tail);
+             off = tail & (dev->in_ring_size - 1);
+             first = min_t(size_t, n, dev->in_ring_size - off);
+             trace_xserve_fp_read_copy(dev->minor, n);
+             if (copy_to_user(buffer, dev->in_ring + off, first) ||
+                 copy_to_user(buffer + first, dev->in_ring, n - first)) {
+                 mutex_unlock(&client->read_mutex);
+                 return -EFAULT;
+             }
+             /* Pairs with the smp_wmb() in xserve_fp_in_ring_put() */
+             smp_rmb();
+             if (READ_ONCE(dev->in_head) - tail <= window)
+                 break;
+             /* Overwritten during the copy: resynchronize and copy again */
+             mutex_unlock(&client->read_mutex);
+             continue;
+         }
+ 
+         /* Nothing new for this file: report a pending URB error or wait for data */
+         spin_lock_irq(&dev->in_lock);
+         retval = dev->in_error;
+         dev->in_error = 0;
+         spin_unlock_irq(&dev->in_lock);
+         if (!retval && READ_ONCE(dev->disconnected))
+             retval = -ENODEV;
+         mutex_unlock(&client->read_mutex);
+         if (retval)
+             return retval;
+         if (nonblock)
+             return -EAGAIN;
+ 
+         if (wait_event_interruptible(dev->in_wait,
+                                      READ_ONCE(dev->in_head) != READ_ONCE(client->in_tail) ||
+                                      READ_ONCE(dev->in_error) ||
+                                      READ_ONCE(dev->disconnected)))
+             return -ERESTARTSYS;
+     }
+ 
+     WRITE_ONCE(client->in_tail, tail + n);
+     client->in_bytes += n;
+     mutex_unlock(&client->read_mutex);
+     return n;
+ }
+ 
+ /* Context of a synchronous bulk-IN URB, on the reader's stack */
+ struct xserve_fp_sync_urb {
+     struct xserve_fp_urb ctx;       /* for xserve_fp_submit_urb() */
+     struct completion done;
+ };
+ 
+ /* Completion of a synchronous bulk-IN URB */
+ static void xserve_fp_sync_complete(struct urb *urb)
+ {
+     struct xserve_fp_sync_urb *s = container_of(urb->context,
+                                                 struct xserve_fp_sync_urb, ctx);
+ 
+     trace_xserve_fp_urb_complete(urb);
+     complete(&s->done);
+ }
+ 
+ /*
+  * One bulk-IN transfer into bulk_in_buffer, as usb_bulk_msg() but with the
+  * URB on sync_anchor, so disconnect can kill it. Only the submission runs
+  * in a disconnect_srcu read section; waiting does not hold off disconnect.
+  */
+ static int xserve_fp_bulk_in_sync(struct xserve_fp *dev, size_t len, int *actual)
+ {
+     struct xserve_fp_sync_urb s = { .ctx.dev = dev };
+     struct urb *urb;
+     int retval;
+     u64 t0;
+     int idx;
+ 
+     *actual = 0;
+     urb = usb_alloc_urb(0, GFP_KERNEL);
+     if (!urb)
+         return -ENOMEM;
+     usb_fill_bulk_urb(urb, dev->udev,
+                       usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                       dev->bulk_in_buffer, len, xserve_fp_sync_complete, &s.ctx);
+     init_completion(&s.done);
+ 
+     t0 = ktime_get_ns();
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         retval = -ENODEV;
+     } else {
+         usb_anchor_urb(urb, &dev->sync_anchor);
+         retval = xserve_fp_submit_urb(urb, GFP_KERNEL);
+         if (retval) {
+             usb_unanchor_urb(urb);
+             xserve_fp_stat_xfer(dev, XSERVE_FP_EP_BULK_IN, retval, 0, t0);
+         }
+     }
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+     if (retval)
+         goto out;
+ 
+     if (!wait_for_completion_timeout(&s.done, msecs_to_jiffies(XSERVE_FP_IN_TIMEOUT))) {
+         usb_kill_urb(urb);
+         retval = -ETIMEDOUT;
+     } else {
+         retval = urb->status;
+     }
+     *actual = urb->actual_length;
+     xserve_fp_stat_xfer(dev, XSERVE_FP_EP_BULK_IN, retval, *actual, t0);
+ out:
+     usb_free_urb(urb);
+     /* Killed or rejected by disconnect */
+     if (retval && READ_ONCE(dev->disconnected))
+         retval = -ENODEV;
+     return retval;
+ }
+ 
+ /* Read with synchronous bulk-IN transfers until count is filled or a short packet */
+ static ssize_t xserve_fp_read_sync(struct xserve_fp *dev, char __user *buffer,
+                                    size_t count)
+ {
+     size_t total = 0;
+     size_t len;
+     int retval = 0;
+     int bytes_read;
+ 
+     /* in_mutex protects bulk_in_buffer until it has been copied out */
+     if (xserve_fp_lock_timed(dev, &dev->in_mutex, XSERVE_FP_LOCK_IN))
+         return -ERESTARTSYS;
+ 
+     while (total < count) {
+         len = min(dev->bulk_in_size, count - total);
+ 
+         retval = xserve_fp_bulk_in_sync(dev, len, &bytes_read);
+         /* A transfer cut short by its timeout still delivers what arrived */
+         if (retval == -ETIMEDOUT && bytes_read)
+             retval = 0;
+         if (retval)
+             break;
+ 
+         trace_xserve_fp_read_copy(dev->minor, bytes_read);
+         if (copy_to_user(buffer + total, dev->bulk_in_buffer, bytes_read)) {
+             retval = -EFAULT;
+             break;
+         }
+         total += bytes_read;
+ 
+         /* A short packet ends the device's transfer */
+         if (bytes_read < len || signal_pending(current))
+             break;
+     }
+     mutex_unlock(&dev->in_mutex);
+ 
+     /* Data already copied out takes precedence over a later error */
+     if (total)
+         return total;
+     return retval;
+ }
+ 
+ /* File operation: read
+  *
+  * Reads data from the device via bulk IN transfers of up to bulk_in_size
+  * bytes, until count is filled or the device ends a transfer with a short
+  * packet; or from the bulk-IN ring when streaming, at this file's own
+  * position. With O_NONBLOCK or XSERVE_FP_CLIENT_NONBLOCK an empty ring
+  * returns -EAGAIN. When not streaming, nothing tells whether the device has
+  * data without asking it in a transfer that may sleep, so a nonblocking read
+  * always returns -EAGAIN and only blocking reads see bulk data.
+  */
+ static ssize_t xserve_fp_read(struct file *file, char __user *buffer,
+                               size_t count, loff_t *ppos)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     bool nonblock = xserve_fp_nonblock(file);
+     ssize_t retval;
+ 
+     if (count == 0)
+         return 0;
+ 
+     trace_xserve_fp_read_enter(dev->minor, count, nonblock);
+     if (dev->stream_in)
+         retval = xserve_fp_read_stream(client, buffer, count, nonblock);
+     else if (nonblock)
+         retval = -EAGAIN;
+     else
+         retval = xserve_fp_read_sync(dev, buffer, count);
+     trace_xserve_fp_read_exit(dev->minor, retval);
+     return retval;
+ }
+ 
+ /*
+  * Can a write from ubuf go out as a scatter-gather transfer? Page segments
+  * are multiples of wMaxPacketSize, so only an unaligned first segment needs
+  * a controller without SG length constraints; otherwise the transfer would
+  * end early on a short packet.
+  */
+ static bool xserve_fp_can_sg(struct xserve_fp *dev, const char __user *ubuf)
+ {
+     struct usb_bus *bus = dev->udev->bus;
+ 
+     return bus->sg_tablesize > 0 &&
+            (bus->no_sg_constraint || offset_in_page(ubuf) == 0);
+ }
+ 
+ /* The device stopped taking data: give up, as usb_bulk_msg() would */
+ static void xserve_fp_sg_timeout(struct work_struct *work)
+ {
+     struct xserve_fp_sg_write *w = container_of(to_delayed_work(work),
+                                                 struct xserve_fp_sg_write, timeout);
+ 
+     WRITE_ONCE(w->timed_out, true);
+     usb_sg_cancel(&w->io);
+ }
+ 
+ /*
+  * Write straight from pinned user pages, waiting for the transfer to finish
+  * for at most XSERVE_FP_SG_TIMEOUT
+  */
+ static ssize_t xserve_fp_write_sg(struct xserve_fp_client *client,
+                                   const char __user *user_buffer, size_t count)
+ {
+     struct xserve_fp *dev = client->dev;
+     unsigned long start = (unsigned long)user_buffer;
+     unsigned int offset = offset_in_page(start);
+     struct xserve_fp_sg_write w;
+     struct sg_table sgt;
+     struct page **pages;
+     int nr_pages, pinned;
+     ssize_t retval;
+     u64 t0;
+     int idx;
+     int i;
+ 
+     count = min_t(size_t, count, XSERVE_FP_SG_MAX);
+     nr_pages = DIV_ROUND_UP(offset + count, PAGE_SIZE);
+ 
+     /*
+      * Keep the byte stream in order behind the chunks every file has queued.
+      * out_mutex is held until the transfer is done, so no chunked or
+      * zero-copy write can land in the middle of it.
+      */
+     if (xserve_fp_lock_timed(dev, &dev->out_mutex, XSERVE_FP_LOCK_OUT))
+         return -ERESTARTSYS;
+     if (!wait_event_timeout(dev->out_wait,
+                             READ_ONCE(dev->out_nfree) == XSERVE_FP_OUT_URBS,
+                             msecs_to_jiffies(XSERVE_FP_OUT_TIMEOUT))) {
+         /* No chunk is queued without out_mutex, so none is reused meanwhile */
+         for (i = 0; i < XSERVE_FP_OUT_URBS; ++i)
+             usb_kill_urb(dev->out_urbs[i]);
+     }
+     retval = xserve_fp_out_error(client);
+     if (retval)
+         goto out_unlock;
+ 
+     pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+     if (!pages) {
+         retval = -ENOMEM;
+         goto out_unlock;
+     }
+ 
+     pinned = pin_user_pages_fast(start, nr_pages, 0, pages);
+     if (pinned != nr_pages) {
+         retval = pinned < 0 ? pinned : -EFAULT;
+         goto out_unpin;
+     }
+ 
+     retval = sg_alloc_table_from_pages(&sgt, pages, nr_pages, offset, count,
+                                        GFP_KERNEL);
+     if (retval)
+         goto out_unpin;
+ 
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         retval = -ENODEV;
+     } else {
+         t0 = ktime_get_ns();
+         retval = usb_sg_init(&w.io, dev->udev,
+                              usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+                              0, sgt.sgl, sgt.nents, count, GFP_KERNEL);
+         if (!retval) {
+             w.timed_out = false;
+             INIT_DELAYED_WORK_ONSTACK(&w.timeout, xserve_fp_sg_timeout);
+             mutex_lock(&dev->sg_mutex);
+             list_add_tail(&w.node, &dev->sg_writes);
+             /* Disconnect may have swept sg_writes before this write was added */
+             if (READ_ONCE(dev->disconnected))
+                 usb_sg_cancel(&w.io);
+             mutex_unlock(&dev->sg_mutex);
+ 
+             schedule_delayed_work(&w.timeout, msecs_to_jiffies(XSERVE_FP_SG_TIMEOUT));
+             usb_sg_wait(&w.io);
+             cancel_delayed_work_sync(&w.timeout);
+             destroy_delayed_work_on_stack(&w.timeout);
+             mutex_lock(&dev->sg_mutex);
+             list_del(&w.node);
+             mutex_unlock(&dev->sg_mutex);
+ 
+             xserve_fp_stat_xfer(dev, XSERVE_FP_EP_BULK_OUT, w.io.status, w.io.bytes, t0);
+             if (w.timed_out)
+                 retval = -ETIMEDOUT;
+             else if (w.io.status == -ECONNRESET && READ_ONCE(dev->disconnected))
+                 retval = -ENODEV;
+             else
+                 retval = w.io.status ? w.io.status : w.io.bytes;
+         }
+     }
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+ 
+     sg_free_table(&sgt);
+ out_unpin:
+     if (pinned > 0)
+         unpin_user_pages(pages, pinned);
+     kvfree(pages);
+ out_unlock:
+     mutex_unlock(&dev->out_mutex);
+     return retval;
+ }
+ 
+ /* Queue one chunk of a write on a free bulk-OUT URB */
+ static int xserve_fp_write_chunk(struct xserve_fp_client *client,
+                                  const char __user *user_buffer, size_t len, bool nonblock)
+ {
+     struct xserve_fp *dev = client->dev;
+     struct urb *urb;
+     int retval;
+     int idx;
+ 
+     /* Limit the number of URBs in flight to stop a user from using up all RAM */
+     if (nonblock) {
+         if (down_trylock(&dev->limit_sem))
+             return -EAGAIN;
+     } else if (down_interruptible(&dev->limit_sem)) {
+         return -ERESTARTSYS;
+     }
+ 
+     spin_lock_irq(&dev->out_lock);
+     urb = dev->out_free[--dev->out_nfree];
+     spin_unlock_irq(&dev->out_lock);
+ 
+     if (copy_from_user(urb->transfer_buffer, user_buffer, len)) {
+         retval = -EFAULT;
+         goto error;
+     }
+     urb->transfer_buffer_length = len;
+ 
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         srcu_read_unlock(&dev->disconnect_srcu, idx);
+         retval = -ENODEV;
+         goto error;
+     }
+     container_of(urb->context, struct xserve_fp_out_urb, ctx)->client = client;
+     usb_anchor_urb(urb, &client->out_anchor);
+     retval = xserve_fp_submit_urb(urb, GFP_KERNEL);
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+     if (retval) {
+         usb_unanchor_urb(urb);
+         dev_err(&dev->interface->dev,
+                 "Failed to submit bulk-OUT URB: %d\n", retval);
+         goto error;
+     }
+     return 0;
+ 
+ error:
+     spin_lock_irq(&dev->out_lock);
+     dev->out_free[dev->out_nfree++] = urb;
+     spin_unlock_irq(&dev->out_lock);
+     up(&dev->limit_sem);
+     return retval;
+ }
+ 
+ /* Queue a write on the bulk-OUT URB pool, one chunk per URB */
+ static ssize_t xserve_fp_write_chunks(struct xserve_fp_client *client,
+                                       const char __user *user_buffer, size_t count,
+                                       bool nonblock)
+ {
+     struct xserve_fp *dev = client->dev;
+     size_t done = 0;
+     size_t len;
+     int retval;
+ 
+     /* Keep the chunks of one write contiguous on the wire */
+     if (nonblock) {
+         if (!mutex_trylock(&dev->out_mutex))
+             return -EAGAIN;
+     } else if (xserve_fp_lock_timed(dev, &dev->out_mutex, XSERVE_FP_LOCK_OUT)) {
          return -ERESTARTSYS;
      }
-     retval = usb_bulk_msg(dev->udev,
-                           usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-                           buf,
-                           count,
-                           &bytes_written,
-                           5000);
-     mutex_unlock(&dev->io_mutex);
-     kfree(buf);
+ 
+     retval = xserve_fp_out_error(client);
+     while (!retval && done < count) {
+         len = min_t(size_t, count - done, XSERVE_FP_OUT_BUFSIZE);
+         retval = xserve_fp_write_chunk(client, user_buffer + done, len, nonblock);
+         if (retval)
+             break;
+         done += len;
+         /* Leave a failure of an earlier chunk latched for the next call */
+         if (READ_ONCE(client->out_error))
+             break;
+     }
+     mutex_unlock(&dev->out_mutex);
+ 
+     if (done)
+         return done;
+     return retval;
+ }
+ 
+ /* File operation: write
+  *
+  * Splits the data into XSERVE_FP_OUT_BUFSIZE chunks, queues each as a bulk
+  * OUT transfer on the preallocated URB pool and returns without waiting for
+  * them. At most XSERVE_FP_OUT_URBS chunks are in flight, so memory use is
+  * bounded whatever the write size. If queueing stops early (signal, full
+  * pool with O_NONBLOCK, or a failed earlier transfer) the bytes already
+  * queued are returned; an error from an earlier write on this file is
+  * returned instead of queueing new data.
+  *
+  * Blocking writes of at least sg_write_threshold bytes are instead sent
+  * zero-copy from the pinned user pages, and return once they complete.
+  */
+ static ssize_t xserve_fp_write(struct file *file, const char __user *user_buffer,
+                                size_t count, loff_t *ppos)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     bool nonblock = xserve_fp_nonblock(file);
+     unsigned int threshold;
+     ssize_t retval;
+ 
+     if (count == 0)
+         return 0;
+ 
+     trace_xserve_fp_write_enter(dev->minor, count, nonblock);
+     threshold = READ_ONCE(sg_write_threshold);
+     if (threshold && count >= threshold && !nonblock &&
+         xserve_fp_can_sg(dev, user_buffer))
+         retval = xserve_fp_write_sg(client, user_buffer, count);
+     else
+         retval = xserve_fp_write_chunks(client, user_buffer, count, nonblock);
+     trace_xserve_fp_write_exit(dev->minor, retval);
+     return retval;
+ }
+ 
+ /* File operation: flush
+  *
+  * Called on every close: wait for the writes queued through this file and
+  * report any error they hit. A file that never wrote returns at once.
+  */
+ static int xserve_fp_flush(struct file *file, fl_owner_t id)
+ {
+     struct xserve_fp_client *client = file->private_data;
+ 
+     return xserve_fp_out_drain(client);
+ }
+ 
+ /* File operation: fsync */
+ static int xserve_fp_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+ {
+     struct xserve_fp_client *client = file->private_data;
+ 
+     return xserve_fp_out_drain(client);
+ }
+ 
+ /*
+  * Does the file have an unread event of a subscribed type? The type may be
+  * read from a record being overwritten; a false positive only costs the
+  * caller an empty READ_EVENTS.
+  */
+ static bool xserve_fp_ev_pending(struct xserve_fp_client *client)
+ {
+     struct xserve_fp *dev = client->dev;
+     unsigned int head = smp_load_acquire(&dev->ev_head);
+     unsigned int tail = READ_ONCE(client->ev_tail);
+     u32 mask = READ_ONCE(client->ev_mask);
+ 
+     /* An overrun is reported by the next READ_EVENTS */
+     if (mask == XSERVE_FP_EV_MASK_ALL || head - tail >= XSERVE_FP_EVENT_QUEUE)
+         return head != tail;
+     for (; tail != head; ++tail) {
+         if (xserve_fp_ev_wanted(mask,
+                                 READ_ONCE(dev->ev_queue[tail & (XSERVE_FP_EVENT_QUEUE - 1)].type)))
+             return true;
+     }
+     return false;
+ }
+ 
+ /* File operation: poll
+  *
+  * EPOLLIN when the bulk-IN ring holds data this file has not read (never
+  * when not streaming, as there is no ring), EPOLLIN | EPOLLPRI when an event of a subscribed type
+  * is queued (in the mapped event ring if there is one), EPOLLOUT when a write
+  * URB is free, EPOLLERR for a bulk-IN error or a write error latched on this
+  * file and EPOLLHUP once the device is gone.
+  */
+ static __poll_t xserve_fp_poll(struct file *file, poll_table *wait)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     struct xserve_fp_ring *ring;
+     __poll_t mask = 0;
+ 
+     poll_wait(file, &dev->in_wait, wait);
+     poll_wait(file, &dev->out_wait, wait);
+     poll_wait(file, &dev->ev_wait, wait);
+ 
+     if (READ_ONCE(dev->disconnected))
+         return EPOLLERR | EPOLLHUP;
+ 
+     if (dev->stream_in &&
+         smp_load_acquire(&dev->in_head) != READ_ONCE(client->in_tail))
+         mask |= EPOLLIN | EPOLLRDNORM;
+     /* A client that mapped an event ring is only woken for its own ring */
+     ring = READ_ONCE(client->ring);
+     if (ring) {
+         if (READ_ONCE(ring->head) != smp_load_acquire(&ring->hdr->tail))
+             mask |= EPOLLIN | EPOLLPRI;
+     } else if (xserve_fp_ev_pending(client)) {
+         mask |= EPOLLIN | EPOLLPRI;
+     }
+     if (READ_ONCE(dev->out_nfree))
+         mask |= EPOLLOUT | EPOLLWRNORM;
+     if (READ_ONCE(dev->in_error) || READ_ONCE(client->out_error))
+         mask |= EPOLLERR;
+     return mask;
+ }
+ 
+ /* Allocate an event ring sized for a mapping of len bytes */
+ static struct xserve_fp_ring *xserve_fp_ring_alloc(size_t len)
+ {
+     struct xserve_fp_ring *ring;
+ 
+     ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+     if (!ring)
+         return NULL;
+     /* vmalloc_user() zeroes the area and makes it mappable */
+     ring->hdr = vmalloc_user(len);
+     if (!ring->hdr) {
+         kfree(ring);
+         return NULL;
+     }
+     ring->bytes = len;
+     ring->records = (void *)ring->hdr + PAGE_SIZE;
+     ring->size = rounddown_pow_of_two((len - PAGE_SIZE) / sizeof(struct xserve_fp_event));
+     ring->hdr->size = ring->size;
+     ring->hdr->record_size = sizeof(struct xserve_fp_event);
+     ring->hdr->data_offset = PAGE_SIZE;
+     return ring;
+ }
+ 
+ /* Map the device's status page, read-only and shared by every open file */
+ static int xserve_fp_mmap_status(struct xserve_fp *dev, struct vm_area_struct *vma)
+ {
+     if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+         return -EINVAL;
+     if (vma->vm_flags & VM_WRITE)
+         return -EPERM;
+     if (READ_ONCE(dev->disconnected))
+         return -ENODEV;
+ 
+     /* Nor can mprotect() make it writable later */
+ #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+     vm_flags_clear(vma, VM_MAYWRITE);
+ #else
+     vma->vm_flags &= ~VM_MAYWRITE;
+ #endif
+     return remap_vmalloc_range(vma, dev->spage, 0);
+ }
+ 
+ /* File operation: mmap
+  *
+  * Map this open file's event ring. The first mmap() sizes and creates the
+  * ring; later mappings must use the same length and share it. The status
+  * page is mapped at its own offset.
+  */
+ static int xserve_fp_mmap(struct file *file, struct vm_area_struct *vma)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     size_t len = vma->vm_end - vma->vm_start;
+     struct xserve_fp_ring *ring;
+     bool created = false;
+     int retval;
+ 
+     if (vma->vm_pgoff == XSERVE_FP_MMAP_STATUS >> PAGE_SHIFT)
+         return xserve_fp_mmap_status(dev, vma);
+     if (vma->vm_pgoff != XSERVE_FP_MMAP_EVENTS >> PAGE_SHIFT)
+         return -EINVAL;
+     if (!(vma->vm_flags & VM_SHARED))
+         return -EINVAL;
+     if (len < 2 * PAGE_SIZE || len > XSERVE_FP_MMAP_EVENTS_MAX)
+         return -EINVAL;
+     if (READ_ONCE(dev->disconnected))
+         return -ENODEV;
+ 
+     mutex_lock(&client->mmap_mutex);
+     ring = client->ring;
+     if (ring && ring->bytes != len) {
+         retval = -EBUSY;
+         goto out;
+     }
+     if (!ring) {
+         ring = xserve_fp_ring_alloc(len);
+         if (!ring) {
+             retval = -ENOMEM;
+             goto out;
+         }
+         ring->client = client;
+         created = true;
+     }
+ 
+     retval = remap_vmalloc_range(vma, ring->hdr, 0);
+     if (retval) {
+         if (created) {
+             vfree(ring->hdr);
+             kfree(ring);
+         }
+         goto out;
+     }
+ 
+     if (created) {
+         spin_lock_irq(&dev->ev_rings_lock);
+         list_add_tail(&ring->node, &dev->ev_rings);
+         spin_unlock_irq(&dev->ev_rings_lock);
+         WRITE_ONCE(client->ring, ring);
+     }
+ out:
+     mutex_unlock(&client->mmap_mutex);
+     return retval;
+ }
+ 
+ /* Count event records a file lost to overwriting. Called with the file's ev_mutex held. */
+ static void xserve_fp_ev_lost(struct xserve_fp_client *client, unsigned int n)
+ {
+     struct xserve_fp *dev = client->dev;
+     struct xserve_fp_status_page *p;
+     unsigned long flags;
+ 
+     client->events_lost += n;
+     p = xserve_fp_spage_begin(dev, &flags);
+     WRITE_ONCE(dev->ev_lost, dev->ev_lost + n);
+     p->events_lost = dev->ev_lost;
+     xserve_fp_spage_end(dev, flags);
+ }
+ 
+ /*
+  * XSERVE_FP_IOCTL_READ_EVENTS: copy this file's unread events of the
+  * subscribed types to userspace. Each record is copied out of the shared
+  * queue and kept only if ev_head shows it was not overwritten meanwhile;
+  * the slot after the newest record may be under rewrite and is skipped.
+  */
+ static int xserve_fp_read_events(struct xserve_fp *dev, struct file *file,
+                                  struct xserve_fp_event_read __user *uarg)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp_event_read req;
+     struct xserve_fp_event __user *events;
+     struct xserve_fp_event ev;
+     unsigned int head, tail, n;
+     u32 mask = READ_ONCE(client->ev_mask);
+     int retval = 0;
+ 
+     if (copy_from_user(&req, uarg, sizeof(req)))
+         return -EFAULT;
+     if (req.flags & ~XSERVE_FP_EVENT_WAIT)
+         return -EINVAL;
+     events = u64_to_user_ptr(req.events);
+ 
+     for (;;) {
+         if (mutex_lock_interruptible(&client->ev_mutex))
+             return -ERESTARTSYS;
+         head = smp_load_acquire(&dev->ev_head);
+         tail = client->ev_tail;
+         n = 0;
+         while (tail != head && n < req.count) {
+             if (head - tail >= XSERVE_FP_EVENT_QUEUE) {
+                 xserve_fp_ev_lost(client, head - tail - XSERVE_FP_EVENT_QUEUE + 1);
+                 tail = head - XSERVE_FP_EVENT_QUEUE + 1;
+             }
+             ev = dev->ev_queue[tail & (XSERVE_FP_EVENT_QUEUE - 1)];
+             /* Pairs with the smp_wmb() in xserve_fp_event_put() */
+             smp_rmb();
+             if (READ_ONCE(dev->ev_head) - tail >= XSERVE_FP_EVENT_QUEUE) {
+                 head = smp_load_acquire(&dev->ev_head);
+                 continue;
+             }
+             if (xserve_fp_ev_wanted(mask, ev.type)) {
+                 if (copy_to_user(&events[n], &ev, sizeof(ev))) {
+                     retval = -EFAULT;
+                     break;
+                 }
+                 n++;
+             }
+             tail++;
+         }
+         /* Advance only past the records that reached userspace or were filtered */
+         WRITE_ONCE(client->ev_tail, tail);
+         if (n || retval || !req.count || !(req.flags & XSERVE_FP_EVENT_WAIT))
+             break;
+         mutex_unlock(&client->ev_mutex);
+ 
+         if (READ_ONCE(dev->disconnected))
+             return -ENODEV;
+         if (xserve_fp_nonblock(file))
+             return -EAGAIN;
+         if (wait_event_interruptible(dev->ev_wait,
+                                      xserve_fp_ev_pending(client) ||
+                                      READ_ONCE(dev->disconnected)))
+             return -ERESTARTSYS;
+     }
+     client->events += n;
+     mutex_unlock(&client->ev_mutex);
      if (retval)
          return retval;
-     return bytes_written;
+ 
+     req.count = n;
+     req.lost = client->events_lost;
+     if (copy_to_user(uarg, &req, sizeof(req)))
+         return -EFAULT;
+     return 0;
  }
  
- /* File operation: ioctl
-  *
-  * Handle device‑specific commands via IOCTL.
+ /* XSERVE_FP_IOCTL_GET_CLIENT and _SET_CLIENT: this file's settings and statistics */
+ static int xserve_fp_client_ioctl(struct file *file, unsigned int cmd,
+                                   struct xserve_fp_client_info __user *uarg)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp_client_info info;
+ 
+     if (cmd == XSERVE_FP_IOCTL_SET_CLIENT) {
+         if (copy_from_user(&info, uarg, sizeof(info)))
+             return -EFAULT;
+         if (info.flags & ~XSERVE_FP_CLIENT_NONBLOCK)
+             return -EINVAL;
+         WRITE_ONCE(client->ev_mask, info.ev_mask);
+         WRITE_ONCE(client->flags, info.flags);
+         /* A sleeping READ_EVENTS rechecks its wait condition */
+         wake_up_interruptible(&client->dev->ev_wait);
+         return 0;
+     }
+ 
+     memset(&info, 0, sizeof(info));
+     info.ev_mask = READ_ONCE(client->ev_mask);
+     info.flags = READ_ONCE(client->flags);
+     mutex_lock(&client->read_mutex);
+     info.in_bytes = client->in_bytes;
+     info.in_overruns = client->in_overruns;
+     info.in_lost_bytes = client->in_lost_bytes;
+     mutex_unlock(&client->read_mutex);
+     mutex_lock(&client->ev_mutex);
+     info.events = client->events;
+     info.events_lost = client->events_lost;
+     mutex_unlock(&client->ev_mutex);
+     if (copy_to_user(uarg, &info, sizeof(info)))
+         return -EFAULT;
+     return 0;
+ }
+ 
+ /* Per-call state of an XSERVE_FP_IOCTL_BATCH call */
+ struct xserve_fp_batch_ctx {
+     struct xserve_fp_ctrl_req *reqs;            /* kernel copy */
+     struct xserve_fp_ctrl_req __user *ureqs;
+     int retval;
+ };
+ 
+ /* Pipeline reap callback: hand one result back to userspace */
+ static void xserve_fp_batch_reap(struct xserve_fp_ctrl *c, void *ctx)
+ {
+     struct xserve_fp_batch_ctx *b = ctx;
+     struct xserve_fp_ctrl_req *req = &b->reqs[c->cookie];
+     int status = c->status;
+ 
+     if (status > 0 && req->direction == XSERVE_FP_CTRL_IN &&
+         copy_to_user(u64_to_user_ptr(req->data), c->buf, status))
+         status = -EFAULT;
+     if (put_user(status, &b->ureqs[c->cookie].status))
+         b->retval = -EFAULT;
+ }
+ 
+ /*
+  * XSERVE_FP_IOCTL_BATCH: queue the requests back to back on the control URB
+  * pool, so endpoint 0 is kept busy instead of paying one round trip per
+  * syscall, and report per-request status. With XSERVE_FP_BATCH_NOWAIT the
+  * call returns once everything is queued.
   */
- static long xserve_fp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+ static int xserve_fp_ctrl_batch(struct xserve_fp *dev,
+                                 struct xserve_fp_batch __user *uarg)
  {
-     struct xserve_fp *dev = file->private_data;
+     struct xserve_fp_batch_ctx b = { .retval = 0 };
+     struct xserve_fp_ctrl_pipe pipe = {
+         .dev  = dev,
+         .reap = xserve_fp_batch_reap,
+         .ctx  = &b,
+     };
+     struct xserve_fp_ctrl_req *req;
+     struct xserve_fp_batch batch;
+     struct xserve_fp_ctrl *c;
+     bool detached, in, held = false;
+     int i, status = 0;
+ 
+     if (copy_from_user(&batch, uarg, sizeof(batch)))
+         return -EFAULT;
+     if ((batch.flags & ~XSERVE_FP_BATCH_NOWAIT) ||
+         !batch.count || batch.count > XSERVE_FP_BATCH_MAX)
+         return -EINVAL;
+     detached = batch.flags & XSERVE_FP_BATCH_NOWAIT;
+ 
+     b.ureqs = u64_to_user_ptr(batch.reqs);
+     b.reqs = memdup_user(b.ureqs, batch.count * sizeof(*b.reqs));
+     if (IS_ERR(b.reqs))
+         return PTR_ERR(b.reqs);
+     for (i = 0; i < batch.count; ++i) {
+         /* Nobody would collect the data of a detached IN request */
+         if (b.reqs[i].direction > XSERVE_FP_CTRL_IN ||
+             (detached && b.reqs[i].direction == XSERVE_FP_CTRL_IN) ||
+             b.reqs[i].wLength > XSERVE_FP_CTRL_DATA_MAX || b.reqs[i].__reserved) {
+             kfree(b.reqs);
+             return -EINVAL;
+         }
+     }
+ 
+     for (i = 0; i < batch.count; ++i) {
+         req = &b.reqs[i];
+         in = req->direction == XSERVE_FP_CTRL_IN;
+         /* Passed on to the detached request, which releases it on completion */
+         if (detached) {
+             if (down_interruptible(&dev->ctrl_detached_sem)) {
+                 status = -EINTR;
+                 break;
+             }
+             held = true;
+         }
+         c = xserve_fp_pipe_get(&pipe);
+         if (IS_ERR(c)) {
+             status = PTR_ERR(c) == -ERESTARTSYS ? -EINTR : PTR_ERR(c);
+             break;
+         }
+         if (!in && req->wLength &&
+             copy_from_user(c->buf, u64_to_user_ptr(req->data), req->wLength)) {
+             xserve_fp_ctrl_put(dev, c);
+             status = -EFAULT;
+             break;
+         }
+         c->cookie = i;
+         status = xserve_fp_ctrl_submit(c, req->bRequest, in, req->wValue,
+                                        req->wIndex, req->wLength, detached);
+         if (status) {
+             xserve_fp_ctrl_put(dev, c);
+             break;
+         }
+         held = false;
+         if (!detached)
+             xserve_fp_pipe_push(&pipe, c);
+         else if (put_user(0, &b.ureqs[i].status))
+             b.retval = -EFAULT;
+     }
+     if (held)
+         up(&dev->ctrl_detached_sem);
+     xserve_fp_pipe_drain(&pipe);
+ 
+     /* Report why the batch stopped; the rest is left unsent rather than reordered */
+     for (; i < batch.count; ++i) {
+         if (put_user(status, &b.ureqs[i].status))
+             b.retval = -EFAULT;
+         status = -ECANCELED;
+     }
+ 
+     kfree(b.reqs);
+     return b.retval;
+ }
+ 
+ /* XSERVE_FP_IOCTL_ANIMATE: replace or cancel the keyframe animation of one LED */
+ static int xserve_fp_animate(struct xserve_fp *dev, struct xserve_fp_anim __user *uarg)
+ {
+     struct xserve_fp_keyframe *keys;
+     struct xserve_fp_anim anim;
+     u64 total = 0;
+     unsigned int i;
+ 
+     if (copy_from_user(&anim, uarg, sizeof(anim)))
+         return -EFAULT;
+     if (anim.led >= XSERVE_FP_NUM_LEDS || anim.count > XSERVE_FP_ANIM_MAX_KEYS ||
+         (anim.flags & ~XSERVE_FP_ANIM_GAMMA))
+         return -EINVAL;
+     if (!anim.count) {
+         xserve_fp_player_stop(&dev->anim[anim.led]);
+         return 0;
+     }
+ 
+     keys = memdup_user(u64_to_user_ptr(anim.keyframes), anim.count * sizeof(*keys));
+     if (IS_ERR(keys))
+         return PTR_ERR(keys);
+     for (i = 0; i < anim.count; ++i) {
+         if (keys[i].easing >= XSERVE_FP_EASE_COUNT || keys[i].__reserved) {
+             kfree(keys);
+             return -EINVAL;
+         }
+         total += keys[i].duration_ms;
+     }
+     /* A pass that takes no time would never let the player sleep */
+     if (!total) {
+         kfree(keys);
+         return -EINVAL;
+     }
+ 
+     xserve_fp_player_start(&dev->anim[anim.led], keys, anim.count, anim.repeat,
+                            anim.flags & XSERVE_FP_ANIM_GAMMA);
+     kfree(keys);
+     return 0;
+ }
+ 
+ /* Dispatch one IOCTL command */
+ static long xserve_fp_dev_ioctl(struct xserve_fp *dev, struct file *file,
+                                 unsigned int cmd, unsigned long arg)
+ {
+     struct xserve_fp_status st;
+     struct xserve_fp_led led;
      int retval = 0;
-     int status;
+     u32 status;
+     u64 age_ns;
      int led_val;
+     int idx;
  
-     if (mutex_lock_interruptible(&dev->io_mutex))
-         return -ERESTARTSYS;
+     /* Event reads may sleep and must not hold off disconnect */
+     if (cmd == XSERVE_FP_IOCTL_READ_EVENTS)
+         return xserve_fp_read_events(dev, file, (void __user *)arg);
+     /* Per-file state only, valid after disconnect too */
+     if (cmd == XSERVE_FP_IOCTL_GET_CLIENT || cmd == XSERVE_FP_IOCTL_SET_CLIENT)
+         return xserve_fp_client_ioctl(file, cmd, (void __user *)arg);
+     /* Batches wait for their URBs without holding off disconnect */
+     if (cmd == XSERVE_FP_IOCTL_BATCH)
+         return xserve_fp_ctrl_batch(dev, (void __user *)arg);
+ 
+     /* Endpoint 0 requests are queued by the USB core and need no driver lock */
+     idx = srcu_read_lock(&dev->disconnect_srcu);
+     if (READ_ONCE(dev->disconnected)) {
+         retval = -ENODEV;
+         goto out;
+     }
  
      switch (cmd) {
      case XSERVE_FP_IOCTL_GET_STATUS:
-         /* Example: Retrieve status via a vendor-specific control message.
-          * bRequest value 0x01 is arbitrary and should be defined per your hardware.
+         /* Example: Retrieve status via a vendor-specific control message,
+          * or from the cache while it is younger than status_max_age_ms.
           */
-         retval = usb_control_msg(dev->udev,
-                                  usb_rcvctrlpipe(dev->udev, 0),
-                                  0x01, /* bRequest for GET_STATUS */
-                                  USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-                                  0, 0,
-                                  &status, sizeof(status),
-                                  1000);
-         if (retval < 0)
+         retval = xserve_fp_status_get(dev, false, &status, &age_ns);
+         if (retval)
              goto out;
          if (copy_to_user((int __user *)arg, &status, sizeof(status))) {
              retval = -EFAULT;
              goto out;
          }
-         retval = 0;
+         break;
+ 
+     case XSERVE_FP_IOCTL_GET_STATUS_EX:
+         if (copy_from_user(&st, (void __user *)arg, sizeof(st))) {
+             retval = -EFAULT;
+             goto out;
+         }
+         if (st.flags & ~XSERVE_FP_STATUS_REFRESH) {
+             retval = -EINVAL;
+             goto out;
+         }
+         retval = xserve_fp_status_get(dev, st.flags & XSERVE_FP_STATUS_REFRESH,
+                                       &st.status, &st.age_ns);
+         if (retval)
+             goto out;
+         if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+             retval = -EFAULT;
          break;
  
      case XSERVE_FP_IOCTL_SET_LED:
-         /* Example: Set LED brightness (or similar) via a vendor-specific control message.
-          * bRequest value 0x02 is arbitrary and should match your hardware specification.
+         /* Example: Set LED brightness (or similar) of the identifier LED.
+          * Only the shadow is updated; the flush worker sends the change.
           */
          if (copy_from_user(&led_val, (int __user *)arg, sizeof(led_val))) {
              retval = -EFAULT;
              goto out;
          }
-         retval = usb_control_msg(dev->udev,
-                                  usb_sndctrlpipe(dev->udev, 0),
-                                  0x02, /* bRequest for SET_LED */
-                                  USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-                                  led_val, 0,
-                                  NULL, 0,
-                                  1000);
+         if (led_val < 0 || led_val > XSERVE_FP_LED_MAX) {
+             retval = -EINVAL;
+             goto out;
+         }
+         retval = xserve_fp_led_set(dev, XSERVE_FP_LED_ID, led_val, 0);
+         break;
+ 
+     case XSERVE_FP_IOCTL_SET_LED_EX:
+         if (copy_from_user(&led, (void __user *)arg, sizeof(led))) {
+             retval = -EFAULT;
+             goto out;
+         }
+         if (led.index >= XSERVE_FP_NUM_LEDS || led.brightness > XSERVE_FP_LED_MAX ||
+             (led.flags & ~XSERVE_FP_LED_WRITE_THROUGH) || led.__reserved) {
+             retval = -EINVAL;
+             goto out;
+         }
+         retval = xserve_fp_led_set(dev, led.index, led.brightness, led.flags);
+         break;
+ 
+     case XSERVE_FP_IOCTL_ANIMATE:
+         retval = xserve_fp_animate(dev, (void __user *)arg);
          break;
  
      default:
@@ -391,25 +3885,221 @@
      }
  
  out:
-     mutex_unlock(&dev->io_mutex);
+     srcu_read_unlock(&dev->disconnect_srcu, idx);
+     return retval;
+ }
+ 
+ /* File operation: ioctl
+  *
+  * Handle device‑specific commands via IOCTL.
+  */
+ static long xserve_fp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+ {
+     struct xserve_fp_client *client = file->private_data;
+     struct xserve_fp *dev = client->dev;
+     long retval;
+ 
+     trace_xserve_fp_ioctl_enter(dev->minor, cmd, arg);
+     retval = xserve_fp_dev_ioctl(dev, file, cmd, arg);
+     trace_xserve_fp_ioctl_exit(dev->minor, retval);
      return retval;
  }
  
+ /* Statistics exported under the interface's stats/ sysfs directory */
+ static ssize_t in_overflows_show(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->in_overflows));
+ }
+ static DEVICE_ATTR_RO(in_overflows);
+ 
+ static ssize_t in_dropped_bytes_show(struct device *d, struct device_attribute *attr,
+                                      char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->in_dropped_bytes));
+ }
+ static DEVICE_ATTR_RO(in_dropped_bytes);
+ 
+ static ssize_t events_lost_show(struct device *d, struct device_attribute *attr,
+                                 char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->ev_lost));
+ }
+ static DEVICE_ATTR_RO(events_lost);
+ 
+ static ssize_t status_cache_hits_show(struct device *d, struct device_attribute *attr,
+                                       char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->status_hits));
+ }
+ static DEVICE_ATTR_RO(status_cache_hits);
+ 
+ static ssize_t status_cache_misses_show(struct device *d, struct device_attribute *attr,
+                                         char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->status_misses));
+ }
+ static DEVICE_ATTR_RO(status_cache_misses);
+ 
+ static ssize_t ctrl_errors_show(struct device *d, struct device_attribute *attr,
+                                 char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->ctrl_errors));
+ }
+ static DEVICE_ATTR_RO(ctrl_errors);
+ 
+ static ssize_t irq_errors_show(struct device *d, struct device_attribute *attr,
+                                char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->irq_errors));
+ }
+ static DEVICE_ATTR_RO(irq_errors);
+ 
+ static ssize_t irq_stalls_show(struct device *d, struct device_attribute *attr,
+                                char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->irq_stalls));
+ }
+ static DEVICE_ATTR_RO(irq_stalls);
+ 
+ static ssize_t irq_recoveries_show(struct device *d, struct device_attribute *attr,
+                                    char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->irq_recoveries));
+ }
+ static DEVICE_ATTR_RO(irq_recoveries);
+ 
+ static ssize_t irq_recover_last_us_show(struct device *d, struct device_attribute *attr,
+                                         char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%llu\n", READ_ONCE(dev->irq_recover_last_ns) / NSEC_PER_USEC);
+ }
+ static DEVICE_ATTR_RO(irq_recover_last_us);
+ 
+ static ssize_t irq_recover_max_us_show(struct device *d, struct device_attribute *attr,
+                                        char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%llu\n", READ_ONCE(dev->irq_recover_max_ns) / NSEC_PER_USEC);
+ }
+ static DEVICE_ATTR_RO(irq_recover_max_us);
+ 
+ static struct attribute *xserve_fp_stats_attrs[] = {
+     &dev_attr_in_overflows.attr,
+     &dev_attr_in_dropped_bytes.attr,
+     &dev_attr_events_lost.attr,
+     &dev_attr_status_cache_hits.attr,
+     &dev_attr_status_cache_misses.attr,
+     &dev_attr_ctrl_errors.attr,
+     &dev_attr_irq_errors.attr,
+     &dev_attr_irq_stalls.attr,
+     &dev_attr_irq_recoveries.attr,
+     &dev_attr_irq_recover_last_us.attr,
+     &dev_attr_irq_recover_max_us.attr,
+     NULL,
+ };
+ 
+ static const struct attribute_group xserve_fp_stats_group = {
+     .name  = "stats",
+     .attrs = xserve_fp_stats_attrs,
+ };
+ 
+ /* Settings exported in the interface's sysfs directory */
+ static ssize_t cpu_meter_ms_show(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+ 
+     return sysfs_emit(buf, "%u\n", READ_ONCE(dev->cpu_meter_ms));
+ }
+ 
+ static ssize_t cpu_meter_ms_store(struct device *d, struct device_attribute *attr,
+                                   const char *buf, size_t count)
+ {
+     struct xserve_fp *dev = usb_get_intfdata(to_usb_interface(d));
+     unsigned int ms;
+     int retval;
+ 
+     retval = kstrtouint(buf, 0, &ms);
+     if (retval)
+         return retval;
+     if (ms && ms < XSERVE_FP_CPU_METER_MIN_MS)
+         return -EINVAL;
+     xserve_fp_cpu_meter_set(dev, ms);
+     return count;
+ }
+ static DEVICE_ATTR_RW(cpu_meter_ms);
+ 
+ static struct attribute *xserve_fp_attrs[] = {
+     &dev_attr_cpu_meter_ms.attr,
+     NULL,
+ };
+ 
+ static const struct attribute_group xserve_fp_group = {
+     .attrs = xserve_fp_attrs,
+ };
+ 
+ static const struct attribute_group *xserve_fp_groups[] = {
+     &xserve_fp_group,
+     &xserve_fp_stats_group,
+     NULL,
+ };
+ 
  /* USB driver structure */
  static struct usb_driver xserve_fp_driver = {
      .name       = "xserve_fp",
      .id_table   = xserve_fp_table,
      .probe      = xserve_fp_probe,
      .disconnect = xserve_fp_disconnect,
+     .dev_groups = xserve_fp_groups,
  };
  
+ /* Fill the easing curves of the keyframe players */
+ static void __init xserve_fp_ease_init(void)
+ {
+     unsigned int t;
+ 
+     for (t = 0; t < 256; ++t) {
+         xserve_fp_ease[XSERVE_FP_EASE_LINEAR][t] = t;
+         xserve_fp_ease[XSERVE_FP_EASE_IN][t] = t * t / 255;
+         xserve_fp_ease[XSERVE_FP_EASE_OUT][t] = 255 - (255 - t) * (255 - t) / 255;
+         /* Smoothstep, 3t^2 - 2t^3 */
+         xserve_fp_ease[XSERVE_FP_EASE_IN_OUT][t] = (3 * 255 - 2 * t) * t * t / (255 * 255);
+     }
+ }
+ 
  /* Module initialization */
  static int __init xserve_fp_init(void)
  {
      int result;
+     xserve_fp_ease_init();
+     xserve_fp_debugfs_root = debugfs_create_dir("xserve_fp", NULL);
      result = usb_register(&xserve_fp_driver);
-     if (result)
+     if (result) {
          pr_err("usb_register failed. Error number %d\n", result);
+         debugfs_remove_recursive(xserve_fp_debugfs_root);
+     }
      return result;
  }
  
@@ -417,6 +4107,7 @@
  static void __exit xserve_fp_exit(void)
  {
      usb_deregister(&xserve_fp_driver);
+     debugfs_remove_recursive(xserve_fp_debugfs_root);
  }
  
  module_init(xserve_fp_init);
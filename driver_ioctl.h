@@ -0,0 +1,232 @@
+/*
+ * driver_ioctl.h - Userspace interface of the Apple Xserve Front Panel USB driver.
+ *
+ * Shared by driver.c and by applications that issue IOCTLs on /dev/xserve_fp*.
+ */
+ 
+ #ifndef _XSERVE_FP_IOCTL_H
+ #define _XSERVE_FP_IOCTL_H
+ 
+ #include <linux/ioctl.h>
+ #include <linux/types.h>
+ 
+ /* Bytes of the raw interrupt report kept in each event record */
+ #define XSERVE_FP_EVENT_DATA 16
+ 
+ /* Decoded event types (struct xserve_fp_event.type) */
+ #define XSERVE_FP_EV_RAW         0      /* unknown or short report, see data[] */
+ #define XSERVE_FP_EV_BUTTON      1      /* code: button, value: nonzero while pressed */
+ #define XSERVE_FP_EV_STATUS      2      /* value: device status word */
+ #define XSERVE_FP_EV_ERROR       3      /* code: error code, value: detail */
+ 
+ /* One interrupt-endpoint completion, as queued by the driver */
+ struct xserve_fp_event {
+     __u64 timestamp_ns;             /* CLOCK_MONOTONIC time of the completion */
+     __u32 seq;                      /* report number; a gap means events were lost or filtered */
+     __u16 type;                     /* XSERVE_FP_EV_* */
+     __u16 code;                     /* button or error code */
+     __u32 value;                    /* button state, status word or error detail */
+     __u32 len;                      /* valid bytes in data[] */
+     __u8  data[XSERVE_FP_EVENT_DATA];
+ };
+ 
+ /* XSERVE_FP_IOCTL_READ_EVENTS flags */
+ #define XSERVE_FP_EVENT_WAIT (1U << 0)  /* block until at least one event is queued */
+ 
+ /* Argument of XSERVE_FP_IOCTL_READ_EVENTS */
+ struct xserve_fp_event_read {
+     __u64 events;                   /* user pointer to struct xserve_fp_event[count] */
+     __u32 count;                    /* in: capacity of events; out: records copied */
+     __u32 flags;                    /* XSERVE_FP_EVENT_* */
+     __u64 lost;                     /* out: events this file has lost to overwriting */
+ };
+ 
+ /*
+  * Shared event ring, mapped with mmap(fd, len, PROT_READ | PROT_WRITE,
+  * MAP_SHARED, XSERVE_FP_MMAP_EVENTS). The first page holds the header, the
+  * records start at data_offset. The ring size is negotiated per open by the
+  * mapping length (2 pages up to XSERVE_FP_MMAP_EVENTS_MAX bytes); the driver
+  * rounds the record count down to a power of two and reports it in size.
+  *
+  * Records [tail, head) are valid, indices wrap modulo size. Load head with
+  * acquire semantics, consume the records, then store tail with release
+  * semantics. When the ring is full new events are dropped and counted in
+  * overflows; poll() reports EPOLLIN | EPOLLPRI while head != tail.
+  */
+ #define XSERVE_FP_MMAP_EVENTS      0
+ #define XSERVE_FP_MMAP_EVENTS_MAX  (1 << 20)
+ 
+ struct xserve_fp_ring_header {
+     /* Written by the driver */
+     __u32 head;                     /* next record the driver fills */
+     __u32 size;                     /* records in the ring, a power of two */
+     __u32 record_size;              /* sizeof(struct xserve_fp_event) */
+     __u32 data_offset;              /* byte offset of record 0 in the mapping */
+     __u64 overflows;                /* events dropped on a full ring */
+     __u64 __pad0[5];
+     /* Written by userspace, on its own cache line */
+     __u32 tail;                     /* next record userspace consumes */
+     __u32 __pad1;
+ };
+ 
+ /*
+  * Status page, mapped with mmap(fd, 4096 or the page size, PROT_READ,
+  * MAP_SHARED, XSERVE_FP_MMAP_STATUS). One page per device, shared by all
+  * open files and kept current by the driver without syscalls or USB traffic.
+  * A reader takes a consistent snapshot like this:
+  *
+  *   do {
+  *       seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+  *       snapshot = *page;
+  *       __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  *   } while ((seq & 1) || seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+  *
+  * The page stays readable after the device is unplugged, frozen at its last
+  * state.
+  */
+ #define XSERVE_FP_MMAP_STATUS    0x10000000
+ 
+ struct xserve_fp_status_page {
+     __u32 seq;                      /* odd while the driver updates the page */
+     __u32 status;                   /* device status word */
+     __u64 status_ns;                /* CLOCK_MONOTONIC time of status, 0 if none yet */
+     __u64 update_ns;                /* CLOCK_MONOTONIC time of the last change */
+     __u64 events;                   /* interrupt reports received */
+     __u64 events_lost;              /* events readers lost to overwriting */
+     __u64 irq_errors;               /* failed interrupt transfers */
+     __u8  leds[32];                 /* LED shadow, XSERVE_FP_NUM_LEDS used */
+ };
+ 
+ /*
+  * Per-open settings and statistics (XSERVE_FP_IOCTL_GET_CLIENT, _SET_CLIENT).
+  * Each open file reads the bulk-IN stream and the event queue through its
+  * own cursor, starting at open(), so readers do not take data from each
+  * other. A file that falls a whole ring behind skips to the oldest data
+  * still held and the loss is counted here.
+  */
+ #define XSERVE_FP_EV_MASK(type)  (1U << (type))
+ #define XSERVE_FP_EV_MASK_ALL    0xffffffffU
+ 
+ #define XSERVE_FP_CLIENT_NONBLOCK (1U << 0)  /* as O_NONBLOCK for read, write and READ_EVENTS */
+ 
+ struct xserve_fp_client_info {
+     __u32 ev_mask;                  /* XSERVE_FP_EV_MASK() bits of the types delivered,
+                                        to READ_EVENTS and the event ring; default all */
+     __u32 flags;                    /* XSERVE_FP_CLIENT_* */
+     /* Statistics of this file, ignored by SET_CLIENT */
+     __u64 in_bytes;                 /* bulk-IN bytes read */
+     __u64 in_overruns;              /* times the reader fell a ring behind */
+     __u64 in_lost_bytes;            /* bytes skipped on those overruns */
+     __u64 events;                   /* events returned by READ_EVENTS */
+     __u64 events_lost;              /* events overwritten before READ_EVENTS got them */
+ };
+ 
+ /* Batched vendor control requests (XSERVE_FP_IOCTL_BATCH) */
+ #define XSERVE_FP_BATCH_MAX      64     /* requests per batch */
+ #define XSERVE_FP_CTRL_DATA_MAX  64     /* largest data stage per request */
+ 
+ #define XSERVE_FP_CTRL_OUT       0      /* host to device */
+ #define XSERVE_FP_CTRL_IN        1      /* device to host */
+ 
+ /* One vendor request to the device (USB_TYPE_VENDOR | USB_RECIP_DEVICE) */
+ struct xserve_fp_ctrl_req {
+     __u8  bRequest;
+     __u8  direction;                /* XSERVE_FP_CTRL_IN or XSERVE_FP_CTRL_OUT */
+     __u16 wValue;
+     __u16 wIndex;
+     __u16 wLength;                  /* data stage length, at most XSERVE_FP_CTRL_DATA_MAX */
+     __u64 data;                     /* user pointer to the data stage buffer */
+     __s32 status;                   /* out: bytes transferred or negative errno,
+                                        0 once queued with XSERVE_FP_BATCH_NOWAIT */
+     __u32 __reserved;               /* zero */
+ };
+ 
+ /* XSERVE_FP_IOCTL_BATCH flags */
+ #define XSERVE_FP_BATCH_NOWAIT   (1U << 0)  /* return once queued; OUT requests only */
+ 
+ /* Argument of XSERVE_FP_IOCTL_BATCH */
+ struct xserve_fp_batch {
+     __u64 reqs;                     /* user pointer to struct xserve_fp_ctrl_req[count] */
+     __u32 count;                    /* 1 to XSERVE_FP_BATCH_MAX */
+     __u32 flags;                    /* XSERVE_FP_BATCH_* */
+ };
+ 
+ /*
+  * Panel LEDs, addressed by the wIndex of the SET_LED vendor request: the
+  * system identifier LED and two 8-segment CPU activity bars.
+  */
+ #define XSERVE_FP_NUM_BARS       2
+ #define XSERVE_FP_BAR_SEGMENTS   8
+ #define XSERVE_FP_LED_ID         0      /* target of XSERVE_FP_IOCTL_SET_LED */
+ #define XSERVE_FP_LED_BAR(bar, seg) (1 + (bar) * XSERVE_FP_BAR_SEGMENTS + (seg))
+ #define XSERVE_FP_NUM_LEDS       (1 + XSERVE_FP_NUM_BARS * XSERVE_FP_BAR_SEGMENTS)
+ #define XSERVE_FP_LED_MAX        255    /* full brightness */
+ 
+ /* XSERVE_FP_IOCTL_SET_LED_EX flags */
+ #define XSERVE_FP_LED_WRITE_THROUGH (1U << 0)  /* send now and wait for the device */
+ 
+ /* Argument of XSERVE_FP_IOCTL_SET_LED_EX */
+ struct xserve_fp_led {
+     __u32 index;                    /* below XSERVE_FP_NUM_LEDS */
+     __u32 brightness;               /* 0 to XSERVE_FP_LED_MAX */
+     __u32 flags;                    /* XSERVE_FP_LED_* */
+     __u32 __reserved;               /* zero */
+ };
+ 
+ /* XSERVE_FP_IOCTL_GET_STATUS_EX flags */
+ #define XSERVE_FP_STATUS_REFRESH (1U << 0)     /* bypass the cache and ask the device */
+ 
+ /* Argument of XSERVE_FP_IOCTL_GET_STATUS_EX */
+ struct xserve_fp_status {
+     __u32 flags;                    /* in: XSERVE_FP_STATUS_* */
+     __u32 status;                   /* out: device status word */
+     __u64 age_ns;                   /* out: time since the device reported it */
+ };
+ 
+ /* Keyframe animations (XSERVE_FP_IOCTL_ANIMATE) */
+ #define XSERVE_FP_ANIM_MAX_KEYS  64     /* keyframes per animation */
+ 
+ /* How a keyframe moves from the previous brightness to its own */
+ #define XSERVE_FP_EASE_STEP      0      /* jump at the start, then hold */
+ #define XSERVE_FP_EASE_LINEAR    1
+ #define XSERVE_FP_EASE_IN        2      /* quadratic, slow start */
+ #define XSERVE_FP_EASE_OUT       3      /* quadratic, slow end */
+ #define XSERVE_FP_EASE_IN_OUT    4      /* smoothstep */
+ 
+ struct xserve_fp_keyframe {
+     __u32 duration_ms;              /* time to reach brightness */
+     __u8  brightness;               /* target, 0 to XSERVE_FP_LED_MAX */
+     __u8  easing;                   /* XSERVE_FP_EASE_* */
+     __u16 __reserved;               /* zero */
+ };
+ 
+ /* XSERVE_FP_IOCTL_ANIMATE flags */
+ #define XSERVE_FP_ANIM_GAMMA     (1U << 0)  /* brightness is perceptual, apply gamma 2.2 */
+ 
+ /*
+  * Argument of XSERVE_FP_IOCTL_ANIMATE. The driver plays the keyframes on the
+  * LED, starting from its current brightness, until the last pass ends on the
+  * final keyframe. A new animation replaces the running one at once; count 0
+  * cancels it and leaves the LED as it is. The output goes through the LED
+  * shadow, so changes faster than led_flush_ms are coalesced.
+  */
+ struct xserve_fp_anim {
+     __u32 led;                      /* below XSERVE_FP_NUM_LEDS */
+     __u32 count;                    /* keyframes, 0 to XSERVE_FP_ANIM_MAX_KEYS */
+     __u32 repeat;                   /* passes, 0 forever */
+     __u32 flags;                    /* XSERVE_FP_ANIM_* */
+     __u64 keyframes;                /* user pointer to struct xserve_fp_keyframe[count] */
+ };
+ 
+ /* Device-specific IOCTL commands */
+ #define XSERVE_FP_IOCTL_GET_STATUS  _IOR('x', 1, int)
+ #define XSERVE_FP_IOCTL_SET_LED     _IOW('x', 2, int)
+ #define XSERVE_FP_IOCTL_READ_EVENTS _IOWR('x', 3, struct xserve_fp_event_read)
+ #define XSERVE_FP_IOCTL_BATCH       _IOW('x', 4, struct xserve_fp_batch)
+ #define XSERVE_FP_IOCTL_SET_LED_EX  _IOW('x', 5, struct xserve_fp_led)
+ #define XSERVE_FP_IOCTL_GET_STATUS_EX _IOWR('x', 6, struct xserve_fp_status)
+ #define XSERVE_FP_IOCTL_ANIMATE     _IOW('x', 7, struct xserve_fp_anim)
+ #define XSERVE_FP_IOCTL_GET_CLIENT  _IOR('x', 8, struct xserve_fp_client_info)
+ #define XSERVE_FP_IOCTL_SET_CLIENT  _IOW('x', 9, struct xserve_fp_client_info)
+ 
+ #endif /* _XSERVE_FP_IOCTL_H */
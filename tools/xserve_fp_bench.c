@@ -0,0 +1,249 @@
+/*
+ * xserve_fp_bench.c - Lock-contention benchmark for the Xserve Front Panel driver.
+ *
+ * Runs reader, writer and ioctl threads against one device node at the same
+ * time and reports the latency of each kind of operation. Every thread opens
+ * the node itself. Before the I/O paths were split, one driver mutex covered
+ * all three, so a reader blocked in a 5 s bulk transfer showed up as the
+ * ioctl and write latency; now they should not affect each other.
+ *
+ *   cc -O2 -Wall -pthread -o xserve_fp_bench tools/xserve_fp_bench.c
+ *   ./xserve_fp_bench -d /dev/xserve_fp0 -r 2 -w 2 -i 4 -t 10
+ *
+ * Needs the panel attached.
+ */
+ 
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <pthread.h>
+ #include <stdint.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <time.h>
+ #include <unistd.h>
+ #include <sys/ioctl.h>
+ 
+ #include "../driver_ioctl.h"
+ 
+ #define BENCH_BUCKETS 40                /* log2 nanosecond buckets, up to ~18 min */
+ #define BENCH_MAX_THREADS 64
+ 
+ enum bench_op {
+     BENCH_READ,
+     BENCH_WRITE,
+     BENCH_IOCTL,
+     BENCH_NR_OPS,
+ };
+ 
+ static const char *const bench_op_names[BENCH_NR_OPS] = {
+     [BENCH_READ]  = "read",
+     [BENCH_WRITE] = "write",
+     [BENCH_IOCTL] = "ioctl",
+ };
+ 
+ /* Latencies of one thread, merged per operation at the end */
+ struct bench_stats {
+     uint64_t ops;
+     uint64_t errors;
+     uint64_t total_ns;
+     uint64_t max_ns;
+     uint64_t hist[BENCH_BUCKETS];
+ };
+ 
+ struct bench_thread {
+     pthread_t tid;
+     int op;                         /* enum bench_op */
+     int fd;
+     struct bench_stats stats;
+ };
+ 
+ static const char *bench_dev = "/dev/xserve_fp0";
+ static size_t bench_size = 4096;        /* bytes per read() and write() */
+ static int bench_get_status;            /* ioctl threads issue GET_STATUS, not SET_LED */
+ static volatile int bench_stop;
+ 
+ static uint64_t bench_now_ns(void)
+ {
+     struct timespec ts;
+ 
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+ }
+ 
+ static void bench_record(struct bench_stats *s, uint64_t ns, int failed)
+ {
+     unsigned int b = 0;
+ 
+     if (failed) {
+         s->errors++;
+         return;
+     }
+     while (b < BENCH_BUCKETS - 1 && (ns >> (b + 1)))
+         b++;
+     s->ops++;
+     s->total_ns += ns;
+     s->hist[b]++;
+     if (ns > s->max_ns)
+         s->max_ns = ns;
+ }
+ 
+ static void *bench_worker(void *arg)
+ {
+     struct bench_thread *t = arg;
+     char *buf;
+     uint64_t start;
+     int led = 0;
+     int status;
+     int failed;
+ 
+     buf = calloc(1, bench_size);
+     if (!buf)
+         return NULL;
+ 
+     while (!bench_stop) {
+         start = bench_now_ns();
+         switch (t->op) {
+         case BENCH_READ:
+             failed = read(t->fd, buf, bench_size) < 0;
+             break;
+         case BENCH_WRITE:
+             failed = write(t->fd, buf, bench_size) < 0;
+             break;
+         default:
+             if (bench_get_status) {
+                 failed = ioctl(t->fd, XSERVE_FP_IOCTL_GET_STATUS, &status) < 0;
+             } else {
+                 led ^= XSERVE_FP_LED_MAX;
+                 failed = ioctl(t->fd, XSERVE_FP_IOCTL_SET_LED, &led) < 0;
+             }
+             break;
+         }
+         /* A read cut short by the end of the run is not a sample */
+         if (failed && errno == EINTR && bench_stop)
+             break;
+         bench_record(&t->stats, bench_now_ns() - start, failed);
+     }
+     free(buf);
+     return NULL;
+ }
+ 
+ /* Upper bound of the bucket holding the given fraction of samples, in ns */
+ static uint64_t bench_percentile(const struct bench_stats *s, double frac)
+ {
+     uint64_t want = (uint64_t)(s->ops * frac);
+     uint64_t seen = 0;
+     unsigned int b;
+ 
+     for (b = 0; b < BENCH_BUCKETS; ++b) {
+         seen += s->hist[b];
+         if (seen > want)
+             return (2ull << b) - 1;
+     }
+     return s->max_ns;
+ }
+ 
+ static void bench_report(const struct bench_thread *threads, int nr)
+ {
+     struct bench_stats sum;
+     int op, i, n;
+     unsigned int b;
+ 
+     printf("%-6s %7s %10s %8s %10s %10s %10s %10s\n",
+            "op", "threads", "ops", "errors", "mean_us", "p50_us", "p99_us", "max_us");
+     for (op = 0; op < BENCH_NR_OPS; ++op) {
+         memset(&sum, 0, sizeof(sum));
+         n = 0;
+         for (i = 0; i < nr; ++i) {
+             const struct bench_stats *s = &threads[i].stats;
+ 
+             if (threads[i].op != op)
+                 continue;
+             n++;
+             sum.ops += s->ops;
+             sum.errors += s->errors;
+             sum.total_ns += s->total_ns;
+             if (s->max_ns > sum.max_ns)
+                 sum.max_ns = s->max_ns;
+             for (b = 0; b < BENCH_BUCKETS; ++b)
+                 sum.hist[b] += s->hist[b];
+         }
+         if (!n)
+             continue;
+         printf("%-6s %7d %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+                bench_op_names[op], n,
+                (unsigned long long)sum.ops, (unsigned long long)sum.errors,
+                sum.ops ? sum.total_ns / 1e3 / sum.ops : 0.0,
+                sum.ops ? bench_percentile(&sum, 0.50) / 1e3 : 0.0,
+                sum.ops ? bench_percentile(&sum, 0.99) / 1e3 : 0.0,
+                sum.max_ns / 1e3);
+     }
+ }
+ 
+ static void bench_usage(const char *prog)
+ {
+     fprintf(stderr,
+             "usage: %s [-d dev] [-r readers] [-w writers] [-i ioctls] [-t seconds]\n"
+             "          [-s bytes] [-g]\n"
+             "  -g  ioctl threads issue GET_STATUS instead of SET_LED\n"
+             "  percentiles are upper bounds of log2 buckets\n", prog);
+     exit(2);
+ }
+ 
+ int main(int argc, char **argv)
+ {
+     struct bench_thread threads[BENCH_MAX_THREADS];
+     int counts[BENCH_NR_OPS] = { 1, 1, 1 };
+     unsigned int seconds = 10;
+     int nr = 0;
+     int op, i, c;
+ 
+     while ((c = getopt(argc, argv, "d:r:w:i:t:s:g")) != -1) {
+         switch (c) {
+         case 'd': bench_dev = optarg; break;
+         case 'r': counts[BENCH_READ] = atoi(optarg); break;
+         case 'w': counts[BENCH_WRITE] = atoi(optarg); break;
+         case 'i': counts[BENCH_IOCTL] = atoi(optarg); break;
+         case 't': seconds = atoi(optarg); break;
+         case 's': bench_size = strtoul(optarg, NULL, 0); break;
+         case 'g': bench_get_status = 1; break;
+         default: bench_usage(argv[0]);
+         }
+     }
+     if (!bench_size || counts[BENCH_READ] < 0 || counts[BENCH_WRITE] < 0 ||
+         counts[BENCH_IOCTL] < 0 ||
+         counts[BENCH_READ] + counts[BENCH_WRITE] + counts[BENCH_IOCTL] > BENCH_MAX_THREADS)
+         bench_usage(argv[0]);
+ 
+     memset(threads, 0, sizeof(threads));
+     for (op = 0; op < BENCH_NR_OPS; ++op) {
+         for (i = 0; i < counts[op]; ++i, ++nr) {
+             threads[nr].op = op;
+             threads[nr].fd = open(bench_dev, O_RDWR);
+             if (threads[nr].fd < 0) {
+                 fprintf(stderr, "%s: %s\n", bench_dev, strerror(errno));
+                 return 1;
+             }
+         }
+     }
+ 
+     for (i = 0; i < nr; ++i) {
+         if (pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i])) {
+             fprintf(stderr, "pthread_create failed\n");
+             return 1;
+         }
+     }
+     sleep(seconds);
+     bench_stop = 1;
+ 
+     /* Readers may be asleep waiting for data; cancel them out of read() */
+     for (i = 0; i < nr; ++i) {
+         if (threads[i].op == BENCH_READ)
+             pthread_cancel(threads[i].tid);
+         pthread_join(threads[i].tid, NULL);
+         close(threads[i].fd);
+     }
+ 
+     bench_report(threads, nr);
+     return 0;
+ }
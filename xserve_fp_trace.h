@@ -0,0 +1,201 @@
+/*
+ * xserve_fp_trace.h - Tracepoints of the Apple Xserve Front Panel USB driver.
+ *
+ * Included twice by driver.c, the second time with CREATE_TRACE_POINTS defined.
+ * The events appear under events/xserve_fp/ in tracefs, and to perf and bpftrace
+ * as xserve_fp:*. Every event carries a CLOCK_MONOTONIC stamp (ktime) so the
+ * stages of one request can be lined up with event timestamps from the device.
+ */
+ 
+ #undef TRACE_SYSTEM
+ #define TRACE_SYSTEM xserve_fp
+ 
+ #if !defined(_XSERVE_FP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+ #define _XSERVE_FP_TRACE_H
+ 
+ #include <linux/tracepoint.h>
+ #include <linux/usb.h>
+ #include <linux/ktime.h>
+ 
+ #define xserve_fp_show_pipe_type(type)              \
+     __print_symbolic(type,                          \
+                      { PIPE_ISOCHRONOUS, "isoc" },  \
+                      { PIPE_INTERRUPT,   "int" },   \
+                      { PIPE_CONTROL,     "ctrl" },  \
+                      { PIPE_BULK,        "bulk" })
+ 
+ /* Endpoint address of a pipe, with the direction bit as in bEndpointAddress */
+ #define xserve_fp_pipe_ep(pipe) \
+     (usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? USB_DIR_IN : 0))
+ 
+ /* Entry of read() and write() */
+ DECLARE_EVENT_CLASS(xserve_fp_rw_enter,
+     TP_PROTO(int minor, size_t count, bool nonblock),
+     TP_ARGS(minor, count, nonblock),
+     TP_STRUCT__entry(
+         __field(int, minor)
+         __field(size_t, count)
+         __field(bool, nonblock)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->minor = minor;
+         __entry->count = count;
+         __entry->nonblock = nonblock;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("minor=%d count=%zu nonblock=%d ktime=%llu",
+               __entry->minor, __entry->count, __entry->nonblock,
+               __entry->ktime_ns)
+ );
+ 
+ DEFINE_EVENT(xserve_fp_rw_enter, xserve_fp_read_enter,
+     TP_PROTO(int minor, size_t count, bool nonblock),
+     TP_ARGS(minor, count, nonblock)
+ );
+ 
+ DEFINE_EVENT(xserve_fp_rw_enter, xserve_fp_write_enter,
+     TP_PROTO(int minor, size_t count, bool nonblock),
+     TP_ARGS(minor, count, nonblock)
+ );
+ 
+ TRACE_EVENT(xserve_fp_ioctl_enter,
+     TP_PROTO(int minor, unsigned int cmd, unsigned long arg),
+     TP_ARGS(minor, cmd, arg),
+     TP_STRUCT__entry(
+         __field(int, minor)
+         __field(unsigned int, cmd)
+         __field(unsigned long, arg)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->minor = minor;
+         __entry->cmd = cmd;
+         __entry->arg = arg;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("minor=%d cmd=%#x arg=%#lx ktime=%llu",
+               __entry->minor, __entry->cmd, __entry->arg, __entry->ktime_ns)
+ );
+ 
+ /* Return of read(), write() and ioctl(): bytes or a negative errno */
+ DECLARE_EVENT_CLASS(xserve_fp_fop_exit,
+     TP_PROTO(int minor, long ret),
+     TP_ARGS(minor, ret),
+     TP_STRUCT__entry(
+         __field(int, minor)
+         __field(long, ret)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->minor = minor;
+         __entry->ret = ret;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("minor=%d ret=%ld ktime=%llu",
+               __entry->minor, __entry->ret, __entry->ktime_ns)
+ );
+ 
+ DEFINE_EVENT(xserve_fp_fop_exit, xserve_fp_read_exit,
+     TP_PROTO(int minor, long ret),
+     TP_ARGS(minor, ret)
+ );
+ 
+ DEFINE_EVENT(xserve_fp_fop_exit, xserve_fp_write_exit,
+     TP_PROTO(int minor, long ret),
+     TP_ARGS(minor, ret)
+ );
+ 
+ DEFINE_EVENT(xserve_fp_fop_exit, xserve_fp_ioctl_exit,
+     TP_PROTO(int minor, long ret),
+     TP_ARGS(minor, ret)
+ );
+ 
+ /* read() has data, possibly after sleeping, and starts copying it out */
+ TRACE_EVENT(xserve_fp_read_copy,
+     TP_PROTO(int minor, size_t len),
+     TP_ARGS(minor, len),
+     TP_STRUCT__entry(
+         __field(int, minor)
+         __field(size_t, len)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->minor = minor;
+         __entry->len = len;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("minor=%d len=%zu ktime=%llu",
+               __entry->minor, __entry->len, __entry->ktime_ns)
+ );
+ 
+ /*
+  * usb_submit_urb() of any URB the driver owns, with its return value. The
+  * URB fields are taken before submitting: once usb_submit_urb() returns, the
+  * URB may have completed and been reused for another transfer.
+  */
+ TRACE_EVENT(xserve_fp_urb_submit,
+     TP_PROTO(const struct urb *urb, u8 devnum, unsigned int pipe, u32 len, int ret),
+     TP_ARGS(urb, devnum, pipe, len, ret),
+     TP_STRUCT__entry(
+         __field(const void *, urb)
+         __field(u8, devnum)
+         __field(u8, ep)
+         __field(u8, type)
+         __field(u32, len)
+         __field(int, ret)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->urb = urb;
+         __entry->devnum = devnum;
+         __entry->ep = xserve_fp_pipe_ep(pipe);
+         __entry->type = usb_pipetype(pipe);
+         __entry->len = len;
+         __entry->ret = ret;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("urb=%p dev=%u ep=%#04x type=%s len=%u ret=%d ktime=%llu",
+               __entry->urb, __entry->devnum, __entry->ep,
+               xserve_fp_show_pipe_type(__entry->type),
+               __entry->len, __entry->ret, __entry->ktime_ns)
+ );
+ 
+ /* Completion callback entry, before the driver looks at the data */
+ TRACE_EVENT(xserve_fp_urb_complete,
+     TP_PROTO(const struct urb *urb),
+     TP_ARGS(urb),
+     TP_STRUCT__entry(
+         __field(const void *, urb)
+         __field(u8, devnum)
+         __field(u8, ep)
+         __field(u8, type)
+         __field(u32, len)
+         __field(u32, actual)
+         __field(int, status)
+         __field(u64, ktime_ns)
+     ),
+     TP_fast_assign(
+         __entry->urb = urb;
+         __entry->devnum = urb->dev->devnum;
+         __entry->ep = xserve_fp_pipe_ep(urb->pipe);
+         __entry->type = usb_pipetype(urb->pipe);
+         __entry->len = urb->transfer_buffer_length;
+         __entry->actual = urb->actual_length;
+         __entry->status = urb->status;
+         __entry->ktime_ns = ktime_get_ns();
+     ),
+     TP_printk("urb=%p dev=%u ep=%#04x type=%s len=%u actual=%u status=%d ktime=%llu",
+               __entry->urb, __entry->devnum, __entry->ep,
+               xserve_fp_show_pipe_type(__entry->type),
+               __entry->len, __entry->actual, __entry->status, __entry->ktime_ns)
+ );
+ 
+ #endif /* _XSERVE_FP_TRACE_H */
+ 
+ /* Outside the include guard: define_trace.h reads this file again */
+ #undef TRACE_INCLUDE_PATH
+ #define TRACE_INCLUDE_PATH .
+ #undef TRACE_INCLUDE_FILE
+ #define TRACE_INCLUDE_FILE xserve_fp_trace
+ #include <trace/define_trace.h>